@@ -3,6 +3,7 @@
 #include <cglib/rt/triangle_soup.h>
 
 #include <cglib/core/image.h>
+#include <cglib/core/parallel.h>
 #include <complex>
 
 /*
@@ -105,7 +106,7 @@ void Image::filter(Image *target, int kernel_size, float *kernel, WrapMode wrap_
     cg_assert(target);
     cg_assert(target->getWidth() == m_width && target->getHeight() == m_height);
 
-    for (int n = 0; n < m_height; ++n)
+    parallel_for(0, m_height, [&](int n)
     {
         for (int m = 0; m < m_width; ++m)
         {
@@ -124,7 +125,7 @@ void Image::filter(Image *target, int kernel_size, float *kernel, WrapMode wrap_
 
             target->setPixel(m, n, color);
         }
-    }
+    });
 }
 
 /*
@@ -155,7 +156,7 @@ void Image::filter_separable(Image *target, int kernel_size, float *kernel, Wrap
     temp.clear();
 
     // horizontal convolution
-    for (int n = 0; n < m_height; ++n)
+    parallel_for(0, m_height, [&](int n)
     {
         for (int m = 0; m < m_width; ++m)
         {
@@ -170,10 +171,10 @@ void Image::filter_separable(Image *target, int kernel_size, float *kernel, Wrap
 
             temp.setPixel(m, n, color);
         }
-    }
+    });
 
     // vertical convolution
-    for (int n = 0; n < m_height; ++n)
+    parallel_for(0, m_height, [&](int n)
     {
         for (int m = 0; m < m_width; ++m)
         {
@@ -188,7 +189,7 @@ void Image::filter_separable(Image *target, int kernel_size, float *kernel, Wrap
 
             target->setPixel(m, n, color);
         }
-    }
+    });
 }
 
 /**
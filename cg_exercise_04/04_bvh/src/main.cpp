@@ -57,36 +57,63 @@ glm::vec3 render_pixel(int x, int y, RaytracingContext const& context, RenderDat
 				: glm::vec2(u / a - (1.0f - a) * 0.5f, v));
 	}
 
-	std::vector<glm::vec2> samples;
-	int spp = data.context.params.spp;
-
-	if(spp > 1) {
-		int grid_size = int(sqrtf(static_cast<float>(spp)));
-		if(data.context.params.stratified)
-			generate_stratified_samples(&samples, grid_size, grid_size, data.tld);
-		else
-			generate_random_samples(&samples, grid_size, grid_size, data.tld);
-		glm::vec3 accum(0.0f);
-
-		for(size_t i = 0; i < samples.size(); i++) {
-			float fx = float(x) + samples[i].x;
-			float fy = float(y) + samples[i].y;
+	int spp = std::max(1, data.context.params.spp);
+	bool adaptive = data.context.params.adaptive_sampling;
+	glm::ivec2 const pixel(x, y);
 
-			data.x = fx;
-			data.y = fy;
+	if(spp > 1 || adaptive) {
+		glm::vec3 accum(0.0f);
 
-			Ray ray = createPrimaryRay(data, fx, fy);
-			accum += trace_recursive(data, ray, 0/*depth*/);
+		// Without adaptive sampling, this takes exactly one batch of
+		// spp samples. Otherwise, batches are added until the
+		// luminance estimate is accurate enough.
+		int batch_size = spp;
+		int min_samples = adaptive ? std::max(4, batch_size) : batch_size;
+		int max_samples = adaptive ? std::max(min_samples, data.context.params.max_spp) : batch_size;
+		RunningVariance lum;
+
+		// Progressive passes continue the sample sequence of the pixel.
+		std::uint32_t const first_sample = std::uint32_t(data.tld->sample) * std::uint32_t(max_samples);
+
+		while(lum.count + batch_size <= max_samples) {
+			for(int i = 0; i < batch_size; i++) {
+				glm::vec2 const offset = data.context.params.stratified
+					? sample_2d(pixel, first_sample + std::uint32_t(lum.count), SAMPLE_DIM_PIXEL)
+					: glm::vec2(data.tld->rand(), data.tld->rand());
+				float fx = float(x) + offset.x;
+				float fy = float(y) + offset.y;
+
+				data.x = fx;
+				data.y = fy;
+
+				Ray ray = createPrimaryRay(data, fx, fy);
+				glm::vec3 color = trace_recursive(data, ray, 0/*depth*/);
+				accum += color;
+				lum.add(luminance(color));
+			}
+
+			if(lum.count >= min_samples && lum.standard_error() 
+					<= data.context.params.adaptive_threshold * std::max(lum.mean, 1e-2f))
+				break;
 		}
 
-		return accum / float(samples.size());
+		data.num_samples = lum.count;
+		return accum / float(lum.count);
 	}
 	else {
-		float fx = float(x) + 0.5f;
-		float fy = float(y) + 0.5f;
+		// Progressive rendering adds more passes, jitter all but the first.
+		glm::vec2 offset(0.5f);
+		if (data.tld->sample > 0)
+			offset = data.context.params.stratified
+				? sample_2d(pixel, std::uint32_t(data.tld->sample - 1), SAMPLE_DIM_PIXEL)
+				: glm::vec2(data.tld->rand(), data.tld->rand());
+
+		float fx = float(x) + offset.x;
+		float fy = float(y) + offset.y;
 
 		data.x = fx;
 		data.y = fy;
+		data.num_samples = 1;
 
 		Ray ray = createPrimaryRay(data, fx, fy);
 		return trace_recursive(data, ray, 0/*depth*/);
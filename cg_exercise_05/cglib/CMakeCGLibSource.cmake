@@ -3,6 +3,8 @@ set(CGLIB_SOURCE_FILES
 	src/core/gui.cpp
 	src/core/image.cpp
 	src/core/parameters.cpp
+	src/core/profiler.cpp
+	src/core/socket.cpp
 	src/core/stb.cpp
 	src/core/thread_pool.cpp
 	src/core/timer.cpp
@@ -12,6 +14,7 @@ set(CGLIB_SOURCE_FILES
 	src/imgui/imgui_impl_glfw_gl2.cpp
 	src/imgui/imgui_impl_glfw_gl3.cpp
 	src/rt/host_render.cpp
+	src/rt/host_render_distributed.cpp
 	src/rt/material.cpp
 	src/rt/object.cpp
 	src/rt/raytracing_context.cpp
@@ -24,6 +27,9 @@ set(CGLIB_SOURCE_FILES
 	src/rt/texture_mapping.cpp
 	src/core/obj_mesh.cpp
 	src/rt/bvh.cpp
+	src/rt/bvh_compact.cpp
+	src/rt/bvh_linear.cpp
+	src/rt/bvh_wide.cpp
 	src/rt/transform.cpp
 	src/rt/triangle_soup.cpp
 )
@@ -33,6 +33,12 @@ set(CMAKE_USE_RELATIVE_PATHS TRUE)
 
 add_definitions(-DGLM_ENABLE_EXPERIMENTAL -D_USE_MATH_DEFINES -DCGLIB_DIR=\"${CGLIB_DIR}\")
 
+# Per-thread counters and ray timers on the render hot path (see profiler.h).
+option(CG_PROFILING "Count rays, BVH node visits and triangle tests" OFF)
+if(CG_PROFILING)
+	add_definitions(-DCG_PROFILING)
+endif()
+
 #ogl
 set(OpenGL_GL_PREFERENCE GLVND)
 find_package(OpenGL REQUIRED)
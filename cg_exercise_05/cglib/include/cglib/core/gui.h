@@ -4,6 +4,7 @@
 #include <cglib/core/image.h>
 
 #include <functional>
+#include <vector>
 
 class Camera;
 
@@ -15,9 +16,17 @@ namespace GUI {
 		DEFAULT_FLAGS        = DEBUG_CONTEXT,
 	};
 
+	/*
+	 * What a parameter change requires. FLAG_REDRAW and FLAG_REFRESH_SCENE
+	 * retrace the image, FLAG_RESHADE only changes the shading of the
+	 * primary hits, and FLAG_POSTPROCESS only changes the tone mapping
+	 * applied when displaying the frame buffer.
+	 */
 	enum {
 		FLAG_REDRAW        = 1 << 0,
 		FLAG_REFRESH_SCENE = 1 << 1,
+		FLAG_RESHADE       = 1 << 2,
+		FLAG_POSTPROCESS   = 1 << 3,
 	};
 
 	bool keep_running();
@@ -27,7 +36,20 @@ namespace GUI {
 	void draw();
 
 	bool init_host(Parameters& params);
-	int display_host(Image const& frame_buffer, std::function<void()> const& render_overlay);
+	/*
+	 * True if the displayed texture has to be filled again: on the first
+	 * display, when the upload format changes, and for 8 bit uploads when
+	 * the tone mapping changes. The texture is cleared to black when its
+	 * format changes, so pass all completed pixels as dirty then.
+	 */
+	bool needs_full_upload();
+	/*
+	 * Displays the frame buffer. If dirty is given, only these pixel
+	 * rectangles (x0, y0, x1, y1) changed since the last call, and only
+	 * they are read and uploaded. Otherwise, the whole frame buffer is.
+	 */
+	int display_host(Image const& frame_buffer, std::function<void()> const& render_overlay,
+		std::vector<glm::ivec4> const* dirty = nullptr);
 
 	bool init_device(Parameters& params, int context_flags);
 	void display_device();
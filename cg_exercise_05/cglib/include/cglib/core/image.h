@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cglib/core/assert.h>
+
 #include <glm/glm.hpp>
 
 #include <string>
@@ -8,6 +10,8 @@
 #include <complex>
 //#include <omp.h>
 
+class ThreadPool;
+
 class Image
 {
 public:
@@ -36,6 +40,9 @@ public:
 	void load_pfm(std::string const& path);
 
 	void tonemap_01(float exposure, float gamma);
+	// Runs on the given pool, or on ThreadPool::get_active().
+	void desaturate(ThreadPool& pool);
+	void desaturate();
 
 	/*
 	 * Writes a buffer of complex numbers into an image.
@@ -81,6 +88,37 @@ protected:
 
 };
 
+/*
+ * A rectangular window [x0, x1) x [y0, y1) of an image, addressed in image
+ * coordinates. Threads may write disjoint tiles of the same image
+ * concurrently without synchronization.
+ */
+class ImageTile
+{
+public:
+	ImageTile(Image* image, int x0, int y0, int x1, int y1) :
+		m_pixels(image->getPixels()), m_stride(image->getWidth()),
+		m_x0(x0), m_y0(y0), m_x1(x1), m_y1(y1)
+	{}
+
+	int getX0() const { return m_x0; }
+	int getY0() const { return m_y0; }
+	int getX1() const { return m_x1; }
+	int getY1() const { return m_y1; }
+
+	void setPixel(int i, int j, const glm::vec4& pixel)
+	{
+		cg_assert(i >= m_x0 && i < m_x1);
+		cg_assert(j >= m_y0 && j < m_y1);
+		m_pixels[j * m_stride + i] = pixel;
+	}
+
+private:
+	glm::vec4* m_pixels;
+	int m_stride;
+	int m_x0, m_y0, m_x1, m_y1;
+};
+
 struct DiscreteFourier2D
 {
 	static void reconstruct(
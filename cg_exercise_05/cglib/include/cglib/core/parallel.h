@@ -0,0 +1,281 @@
+#pragma once
+
+/*
+ * Data-parallel building blocks on top of the ThreadPool.
+ *
+ * All functions split the index range [begin, end) recursively into halves
+ * and fork them with ThreadPool::spawn() until a piece has at most grain_size
+ * elements. Pieces are processed sequentially, in ascending index order.
+ * A grain_size of 0 picks a grain that gives every worker about eight pieces.
+ *
+ * The calling thread works on the range as well, so these functions may be
+ * called from the main thread or from within a kernel running on the pool.
+ * If no pool is given, ThreadPool::get_active() is used.
+ *
+ * If body, map or combine throw, the remaining pieces still run, and the
+ * first exception is rethrown to the caller once all of them are done.
+ */
+
+#include <cglib/core/thread_pool.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+namespace parallel_detail
+{
+	inline int auto_grain_size(ThreadPool const& pool, int begin, int end, int grain_size)
+	{
+		if (grain_size > 0)
+		{
+			return grain_size;
+		}
+		return std::max(1, (end - begin) / (8 * std::max(1, pool.num_threads())));
+	}
+
+	// Calls body(b, e) for disjoint sub-ranges that cover [begin, end).
+	template <class RangeBody>
+	void split(ThreadPool& pool, int begin, int end, int grain_size, RangeBody const& body)
+	{
+		if (end - begin <= grain_size || pool.num_threads() < 1)
+		{
+			body(begin, end);
+			return;
+		}
+
+		int const mid = begin + (end - begin) / 2;
+		ThreadPool::TaskGroup group;
+		pool.spawn(group, [&]() { split(pool, mid, end, grain_size, body); });
+		std::exception_ptr exception;
+		try
+		{
+			split(pool, begin, mid, grain_size, body);
+		} catch (...)
+		{
+			exception = std::current_exception();
+		}
+		// The spawned half refers to this frame, so join it in any case.
+		pool.sync(group);
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+	}
+
+	template <class T, class Map, class Combine>
+	T reduce(ThreadPool& pool, int begin, int end, int grain_size,
+		T const& identity, Map const& map, Combine const& combine)
+	{
+		if (end - begin <= grain_size || pool.num_threads() < 1)
+		{
+			T result = identity;
+			for (int i = begin; i < end; ++i)
+			{
+				result = combine(result, map(i));
+			}
+			return result;
+		}
+
+		int const mid = begin + (end - begin) / 2;
+		T right = identity;
+		ThreadPool::TaskGroup group;
+		pool.spawn(group, [&]() { right = reduce(pool, mid, end, grain_size, identity, map, combine); });
+		T left = identity;
+		std::exception_ptr exception;
+		try
+		{
+			left = reduce(pool, begin, mid, grain_size, identity, map, combine);
+		} catch (...)
+		{
+			exception = std::current_exception();
+		}
+		pool.sync(group);
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+		return combine(left, right);
+	}
+}
+
+/*
+ * Call body(i) for every i in [begin, end).
+ */
+template <class Body>
+void parallel_for(ThreadPool& pool, int begin, int end, Body const& body, int grain_size = 0)
+{
+	if (begin >= end)
+	{
+		return;
+	}
+	grain_size = parallel_detail::auto_grain_size(pool, begin, end, grain_size);
+	parallel_detail::split(pool, begin, end, grain_size, [&](int b, int e)
+		{
+			for (int i = b; i < e; ++i)
+			{
+				body(i);
+			}
+		});
+}
+
+template <class Body>
+void parallel_for(int begin, int end, Body const& body, int grain_size = 0)
+{
+	parallel_for(ThreadPool::get_active(), begin, end, body, grain_size);
+}
+
+/*
+ * Compute combine(...combine(combine(identity, map(begin)), map(begin+1))..., map(end-1)).
+ *
+ * combine must be associative, and identity must be its neutral element.
+ * The order in which partial results are combined only depends on the range
+ * and the grain size, so an explicit grain_size makes floating point results
+ * independent of the number of threads.
+ */
+template <class T, class Map, class Combine>
+T parallel_reduce(ThreadPool& pool, int begin, int end, T const& identity,
+	Map const& map, Combine const& combine, int grain_size = 0)
+{
+	if (begin >= end)
+	{
+		return identity;
+	}
+	grain_size = parallel_detail::auto_grain_size(pool, begin, end, grain_size);
+	return parallel_detail::reduce(pool, begin, end, grain_size, identity, map, combine);
+}
+
+template <class T, class Map, class Combine>
+T parallel_reduce(int begin, int end, T const& identity,
+	Map const& map, Combine const& combine, int grain_size = 0)
+{
+	return parallel_reduce(ThreadPool::get_active(), begin, end, identity, map, combine, grain_size);
+}
+
+/*
+ * Inclusive prefix scan: output[i] = combine(input[0], ..., input[i]).
+ *
+ * input and output may be the same array. Works in two passes over blocks of
+ * grain_size elements: the first pass reduces every block, the second pass
+ * scans every block starting from the sum of all blocks before it.
+ */
+template <class T, class Combine>
+void parallel_scan(ThreadPool& pool, int n, T const* input, T* output,
+	T const& identity, Combine const& combine, int grain_size = 0)
+{
+	if (n <= 0)
+	{
+		return;
+	}
+	grain_size = parallel_detail::auto_grain_size(pool, 0, n, grain_size);
+	int const num_blocks = (n + grain_size - 1) / grain_size;
+
+	std::vector<T> block_sums(num_blocks, identity);
+	parallel_for(pool, 0, num_blocks, [&](int block)
+		{
+			int const end = std::min(n, (block + 1) * grain_size);
+			T sum = identity;
+			for (int i = block * grain_size; i < end; ++i)
+			{
+				sum = combine(sum, input[i]);
+			}
+			block_sums[block] = sum;
+		}, 1);
+
+	// Exclusive scan over the (few) block sums.
+	T carry = identity;
+	for (int block = 0; block < num_blocks; ++block)
+	{
+		T const sum = block_sums[block];
+		block_sums[block] = carry;
+		carry = combine(carry, sum);
+	}
+
+	parallel_for(pool, 0, num_blocks, [&](int block)
+		{
+			int const end = std::min(n, (block + 1) * grain_size);
+			T sum = block_sums[block];
+			for (int i = block * grain_size; i < end; ++i)
+			{
+				sum = combine(sum, input[i]);
+				output[i] = sum;
+			}
+		}, 1);
+}
+
+template <class T, class Combine>
+void parallel_scan(int n, T const* input, T* output,
+	T const& identity, Combine const& combine, int grain_size = 0)
+{
+	parallel_scan(ThreadPool::get_active(), n, input, output, identity, combine, grain_size);
+}
+
+/*
+ * Sort values by their keys, of which only the lowest key_bits bits are
+ * used. Stable least significant digit radix sort with 8 bit digits: each
+ * pass counts the digits of every block in parallel, scans the counts, and
+ * scatters the blocks in parallel.
+ */
+template <class Value>
+void parallel_radix_sort(ThreadPool& pool, std::vector<std::uint32_t>* keys,
+	std::vector<Value>* values, int key_bits = 32)
+{
+	int const n = static_cast<int>(keys->size());
+	if (n <= 1)
+	{
+		return;
+	}
+	int const num_digits = 256;
+	int const num_blocks = std::max(1, std::min(4 * pool.num_threads(), (n + 4095) / 4096));
+	int const block_size = (n + num_blocks - 1) / num_blocks;
+
+	std::vector<std::uint32_t> keys_out(n);
+	std::vector<Value>         values_out(n);
+	std::vector<int>           offsets(num_blocks * num_digits);
+	for (int shift = 0; shift < key_bits; shift += 8)
+	{
+		parallel_for(pool, 0, num_blocks, [&](int block)
+			{
+				int* const count = offsets.data() + block * num_digits;
+				std::fill(count, count + num_digits, 0);
+				int const end = std::min(n, (block + 1) * block_size);
+				for (int i = block * block_size; i < end; ++i)
+				{
+					count[((*keys)[i] >> shift) & 0xff]++;
+				}
+			}, 1);
+
+		// All blocks' digit 0, then all blocks' digit 1, ...
+		int offset = 0;
+		for (int digit = 0; digit < num_digits; ++digit)
+		{
+			for (int block = 0; block < num_blocks; ++block)
+			{
+				int const count = offsets[block * num_digits + digit];
+				offsets[block * num_digits + digit] = offset;
+				offset += count;
+			}
+		}
+
+		parallel_for(pool, 0, num_blocks, [&](int block)
+			{
+				int* const offset_of = offsets.data() + block * num_digits;
+				int const end = std::min(n, (block + 1) * block_size);
+				for (int i = block * block_size; i < end; ++i)
+				{
+					int const to = offset_of[((*keys)[i] >> shift) & 0xff]++;
+					keys_out[to]   = (*keys)[i];
+					values_out[to] = (*values)[i];
+				}
+			}, 1);
+
+		keys->swap(keys_out);
+		values->swap(values_out);
+	}
+}
+
+template <class Value>
+void parallel_radix_sort(std::vector<std::uint32_t>* keys, std::vector<Value>* values, int key_bits = 32)
+{
+	parallel_radix_sort(ThreadPool::get_active(), keys, values, key_bits);
+}
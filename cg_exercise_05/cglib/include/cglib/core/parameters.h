@@ -3,6 +3,7 @@
 #include <cglib/core/camera.h>
 
 #include <cstdint>
+#include <iosfwd>
 #include <string>
 
 struct CTwBar;
@@ -31,6 +32,10 @@ public:
 	// The number of threads to be used for rendering. Defaults to number of hardware threads -1.
 	int  num_threads;
 
+	// Placement of the worker threads: "none", "compact", "scatter" or a cpu
+	// list such as "0,2,4-7". See ThreadAffinity.
+	std::string thread_affinity = "none";
+
 	// The size of the image to be rendered.
 	int image_width  = 512;
 	int image_height = 512;
@@ -42,11 +47,45 @@ public:
 	// Output filename (used for noninteractive renders).
 	std::string output_file_name = "output.tga";
 
-	// The size of a render tile.
+	// The size of a render tile. 0 picks a size automatically and tunes it
+	// after the first frame.
 	std::uint32_t tile_size = 32;
 
+	// The order in which tiles are rendered. Workers take contiguous runs
+	// of this order, so space-filling curves keep each worker's tiles close
+	// together.
+	enum TileOrder {
+		TILE_ORDER_SPIRAL,
+		TILE_ORDER_HILBERT,
+		TILE_ORDER_MORTON,
+		TILE_ORDER_COUNT
+	};
+
+	const char* tile_order_names[TILE_ORDER_COUNT] = {
+		"spiral", "hilbert", "morton"
+	};
+
+	int tile_order = TILE_ORDER_SPIRAL;
+
 	// In gui mode, display with this many frames per second.
 	std::uint32_t fps = 60;
+
+	// The texel format used to upload the frame buffer for display. Half
+	// floats halve the upload bandwidth, 8 bit quarters it but applies the
+	// tone mapping before the upload, so changing it uploads the whole
+	// frame again.
+	enum DisplayUpload {
+		DISPLAY_UPLOAD_FLOAT32,
+		DISPLAY_UPLOAD_FLOAT16,
+		DISPLAY_UPLOAD_UNORM8,
+		DISPLAY_UPLOAD_COUNT
+	};
+
+	const char* display_upload_names[DISPLAY_UPLOAD_COUNT] = {
+		"float32", "float16", "unorm8"
+	};
+
+	int display_upload = DISPLAY_UPLOAD_FLOAT32;
 	
 	// Run in interactive mode?
 	bool interactive = true;
@@ -55,6 +94,49 @@ public:
 
 	float exposure = 0.0f;
 	float gamma = 2.2f;
+	// Show the luminance only. Like exposure and gamma, this is applied to
+	// the frame buffer on display and when saving screenshots.
+	bool desaturate = false;
+
+	// Benchmark mode: render the scene with this name without GUI and image
+	// output, and write a JSON report. See HostRender::run_benchmark.
+	std::string benchmark_scene;
+	// Untimed frames before and timed frames after.
+	int benchmark_warmup = 1;
+	int benchmark_repeat = 5;
+	// Optional camera path, one pose "px py pz dx dy dz" per line. Frame i
+	// uses pose i, wrapping around. Also used by sequence rendering.
+	std::string benchmark_camera_path;
+	// The file to write the report to. Empty for stdout.
+	std::string benchmark_output;
+
+	// Noninteractive rendering of one image per camera path pose. The first
+	// run of '#' in sequence_output is replaced by the frame number, e.g.
+	// "frames/frame_####.png". Frames are written by sequence_io_threads
+	// background threads while the next frames render; at most
+	// sequence_queue frames wait to be written.
+	std::string sequence_output;
+	int sequence_queue = 4;
+	int sequence_io_threads = 2;
+
+	// Record a timeline of rendered tiles and write it to this file in the
+	// Chrome trace event format when rendering ends. See Profiler.
+	std::string trace_file;
+
+	// Noninteractive rendering with several processes. The coordinator
+	// forks local_workers worker processes, accepts remote_workers more
+	// on listen_address, and hands out the tiles to them. A process with
+	// a worker_address loads the scene with the same command line, renders
+	// the tiles it receives from the coordinator listening there and saves
+	// nothing. Addresses are "unix:PATH" or "HOST:PORT", see MessageSocket.
+	struct Distribution
+	{
+		int         local_workers = 0;
+		int         remote_workers = 0;
+		std::string listen_address;
+		std::string worker_address;
+	};
+	Distribution distribution;
 
 // -------------------------------------------------------------------------
 
@@ -72,5 +154,8 @@ public:
 protected:
 	// Implement the following to handle your own parameters.
 	virtual bool derived_change_requires_restart(Parameters const& old) const { return false; }
+	// Parse the argument of option arg from is. Return false if the option
+	// is unknown, and set *success to false if the argument is invalid.
+	virtual bool derived_parse_option(std::string const& arg, std::istream& is, bool* success) { return false; }
 };
 
@@ -0,0 +1,207 @@
+#pragma once
+
+/*
+ * Low-overhead instrumentation of the renderer.
+ *
+ * - Counters: every thread counts events (rays, BVH node visits, ...) in its
+ *   own slots, so counting is a plain load and store without any locking.
+ * - Scoped timers: accumulate time stamp counter ticks and calls per scope.
+ * - Timeline: scopes opened with CG_PROFILE_TRACE_SCOPE are recorded as
+ *   events while tracing is enabled, and can be written in the Chrome trace
+ *   event format (load the file in chrome://tracing or Perfetto).
+ *
+ * Use the CG_PROFILE_* macros in the renderer. Counters and scoped timers
+ * on the hot path (CG_PROFILE_COUNT, CG_PROFILE_SCOPE) compile to nothing
+ * unless CG_PROFILING is defined (cmake -DCG_PROFILING=ON). Per-tile scopes
+ * (CG_PROFILE_TRACE_SCOPE) and Profiler::ticks() are always available.
+ *
+ * reset(), totals() and write_chrome_trace() read and write the data of all
+ * threads; call them while no thread is rendering, or accept slightly stale
+ * numbers (as the overlay does).
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#else
+#  include <chrono>
+#endif
+
+class Profiler
+{
+	public:
+		enum Counter
+		{
+			PRIMARY_RAYS,
+			SHADOW_RAYS,
+			SECONDARY_RAYS,
+			BVH_NODE_VISITS,
+			TRIANGLE_TESTS,
+			TEXTURE_FETCHES,
+			COUNTER_COUNT
+		};
+
+		enum Scope
+		{
+			SCOPE_TILE,
+			SCOPE_SHOOT_RAY,
+			SCOPE_VISIBLE,
+			SCOPE_SHADE,
+			SCOPE_COUNT
+		};
+
+		static char const* const counter_names[COUNTER_COUNT];
+		static char const* const scope_names[SCOPE_COUNT];
+
+		// Time stamp counter, or nanoseconds where there is none.
+		static inline std::uint64_t ticks()
+		{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#else
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+		}
+
+		// Calibrated once, on first use.
+		static double ticks_per_us();
+
+		static inline double ticks_to_ms(std::uint64_t ticks)
+		{
+			return double(ticks) / (ticks_per_us() * 1000.0);
+		}
+
+		/*
+		 * The data of one thread. Only the owning thread writes to it.
+		 */
+		struct ThreadData
+		{
+			struct TraceEvent
+			{
+				Scope         scope;
+				int           id;
+				std::uint64_t begin;
+				std::uint64_t end;
+			};
+
+			std::string                name;
+			std::atomic<std::uint64_t> counters[COUNTER_COUNT] = {};
+			std::atomic<std::uint64_t> scope_ticks[SCOPE_COUNT] = {};
+			std::atomic<std::uint64_t> scope_calls[SCOPE_COUNT] = {};
+			std::vector<TraceEvent>    events;
+		};
+
+		struct Totals
+		{
+			std::uint64_t counters[COUNTER_COUNT] = {};
+			std::uint64_t scope_ticks[SCOPE_COUNT] = {};
+			std::uint64_t scope_calls[SCOPE_COUNT] = {};
+			// Ticks since the last reset().
+			std::uint64_t elapsed_ticks = 0;
+		};
+
+		static inline ThreadData& local()
+		{
+			thread_local ThreadData* data = register_thread();
+			return *data;
+		}
+
+		static inline void count(Counter counter, std::uint64_t n = 1)
+		{
+			std::atomic<std::uint64_t>& c = local().counters[counter];
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		static inline void add_scope(Scope scope, std::uint64_t begin, std::uint64_t end)
+		{
+			ThreadData& data = local();
+			std::atomic<std::uint64_t>& t = data.scope_ticks[scope];
+			std::atomic<std::uint64_t>& c = data.scope_calls[scope];
+			t.store(t.load(std::memory_order_relaxed) + (end - begin), std::memory_order_relaxed);
+			c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+
+		static inline void add_trace_event(Scope scope, int id, std::uint64_t begin, std::uint64_t end)
+		{
+			if (tracing.load(std::memory_order_relaxed))
+			{
+				std::vector<ThreadData::TraceEvent>& events = local().events;
+				if (events.size() < max_trace_events)
+				{
+					events.push_back({ scope, id, begin, end });
+				}
+			}
+		}
+
+		class ScopedTimer
+		{
+			public:
+				explicit ScopedTimer(Scope scope, int trace_id = -1) :
+					m_scope(scope), m_traceId(trace_id), m_begin(ticks())
+				{}
+
+				~ScopedTimer()
+				{
+					std::uint64_t const end = ticks();
+					add_scope(m_scope, m_begin, end);
+					if (m_traceId >= 0)
+					{
+						add_trace_event(m_scope, m_traceId, m_begin, end);
+					}
+				}
+
+				ScopedTimer(ScopedTimer const&) = delete;
+				ScopedTimer& operator=(ScopedTimer const&) = delete;
+
+			private:
+				Scope         m_scope;
+				int           m_traceId;
+				std::uint64_t m_begin;
+		};
+
+		// Name the calling thread in the trace and the overlay.
+		static void set_thread_name(std::string const& name);
+
+		// Record trace events from now on. Events are kept until
+		// clear_trace(), at most max_trace_events per thread.
+		static void set_tracing(bool enable);
+		static void clear_trace();
+		static bool write_chrome_trace(std::string const& file_name);
+
+		// Zero all counters and scope timers.
+		static void reset();
+		static Totals totals();
+
+		// ImGui widgets showing counters, scopes and per-thread load.
+		static void display();
+
+		static std::size_t const max_trace_events = 1 << 20;
+
+	private:
+		static ThreadData* register_thread();
+
+		static std::atomic<bool> tracing;
+};
+
+#define _CG_PROFILE_CONCAT2(a, b) a##b
+#define _CG_PROFILE_CONCAT1(a, b) _CG_PROFILE_CONCAT2(a, b)
+
+// Opened once per tile, cheap enough to stay on in every build.
+#define CG_PROFILE_TRACE_SCOPE(scope, id) \
+  Profiler::ScopedTimer _CG_PROFILE_CONCAT1(cg_profile_scope_, __LINE__)(Profiler::scope, (id))
+
+#ifdef CG_PROFILING
+#  define CG_PROFILE_COUNT(counter, n) Profiler::count(Profiler::counter, (n))
+#  define CG_PROFILE_SCOPE(scope) \
+     Profiler::ScopedTimer _CG_PROFILE_CONCAT1(cg_profile_scope_, __LINE__)(Profiler::scope)
+#else
+#  define CG_PROFILE_COUNT(counter, n) ((void) 0)
+#  define CG_PROFILE_SCOPE(scope) ((void) 0)
+#endif
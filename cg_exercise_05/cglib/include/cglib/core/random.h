@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Counter-based random numbers.
+ *
+ * Instead of advancing a generator state, every random number is a hash of
+ * a key and a dimension index. The key identifies a sample (e.g. pixel and
+ * sample index), the dimension identifies the random decision within that
+ * sample. Results therefore do not depend on the order of evaluation or on
+ * the thread doing the work.
+ */
+
+// The PCG-RXS-M-XS permutation of 32 bit integers, see
+// Jarzynski and Olano, "Hash Functions for GPU Rendering", JCGT 2020.
+inline std::uint32_t pcg_hash(std::uint32_t v)
+{
+	std::uint32_t const state = v * 747796405u + 2891336453u;
+	std::uint32_t const word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// Key for the random numbers of one sample of one pixel.
+inline std::uint32_t random_key(std::uint32_t x, std::uint32_t y, std::uint32_t sample)
+{
+	return pcg_hash(sample + pcg_hash(y + pcg_hash(x)));
+}
+
+// Map the upper 24 bits to a float in [0, 1).
+inline float random_to_float(std::uint32_t bits)
+{
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Random number in [0, 1) for dimension dim of the given key.
+inline float random_float(std::uint32_t key, std::uint32_t dim)
+{
+	return random_to_float(pcg_hash(key ^ (dim * 0x9e3779b9u)));
+}
+
+// Fill values[0..count) with dimensions first_dim, first_dim + 1, ... of the
+// given key. The iterations are independent, but pcg_hash() shifts every
+// value by a different amount, which SSE2 cannot do per lane, so the loop
+// is only vectorized when building for AVX2.
+inline void random_floats(std::uint32_t key, std::uint32_t first_dim, float* values, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		values[i] = random_float(key, first_dim + std::uint32_t(i));
+	}
+}
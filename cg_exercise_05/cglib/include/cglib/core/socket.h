@@ -0,0 +1,136 @@
+#pragma once
+
+/*
+ * Stream sockets carrying length-prefixed messages, for rendering with
+ * several processes. An address is either "unix:/path/to/socket" or
+ * "host:port" for TCP.
+ *
+ * A message is a 32 bit length followed by that many bytes. Values are
+ * written in native byte order, so all processes must run on the same
+ * architecture. Only available on POSIX systems; elsewhere, connecting and
+ * listening fail with an error message.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+ * A connected socket. Closed on destruction.
+ */
+class MessageSocket
+{
+	public:
+		MessageSocket() = default;
+		explicit MessageSocket(int fd) : m_fd(fd) {}
+		~MessageSocket() { close(); }
+
+		MessageSocket(MessageSocket&& other) : m_fd(other.m_fd) { other.m_fd = -1; }
+		MessageSocket& operator=(MessageSocket&& other);
+		MessageSocket(MessageSocket const&) = delete;
+		MessageSocket& operator=(MessageSocket const&) = delete;
+
+		// Connects to a listening socket, retrying until timeout_seconds
+		// have passed. Returns a closed socket on failure.
+		static MessageSocket connect(std::string const& address, int timeout_seconds);
+
+		bool is_open() const { return m_fd >= 0; }
+		int  fd() const { return m_fd; }
+		void close();
+
+		// Both return false if the connection failed or was closed.
+		bool send(std::vector<char> const& message);
+		bool receive(std::vector<char>* message);
+
+	private:
+		int m_fd = -1;
+};
+
+/*
+ * A socket accepting connections. Unix socket files are removed again on
+ * destruction.
+ */
+class ListenSocket
+{
+	public:
+		ListenSocket() = default;
+		~ListenSocket() { close(); }
+
+		ListenSocket(ListenSocket const&) = delete;
+		ListenSocket& operator=(ListenSocket const&) = delete;
+
+		bool listen(std::string const& address);
+		bool is_open() const { return m_fd >= 0; }
+		void close();
+
+		// Waits at most timeout_ms (or forever, if negative) for a
+		// connection. Returns a closed socket on timeout or failure.
+		MessageSocket accept(int timeout_ms);
+
+	private:
+		int         m_fd = -1;
+		std::string m_unixPath;
+};
+
+// -----------------------------------------------------------------------------
+
+/*
+ * Builds a message from plain values.
+ */
+class MessageWriter
+{
+	public:
+		template <class T>
+		void put(T const& value) { put(&value, 1); }
+
+		template <class T>
+		void put(T const* values, std::size_t count)
+		{
+			std::size_t const offset = m_data.size();
+			m_data.resize(offset + count * sizeof(T));
+			if (count > 0)
+			{
+				std::memcpy(m_data.data() + offset, values, count * sizeof(T));
+			}
+		}
+
+		std::vector<char> const& data() const { return m_data; }
+
+	private:
+		std::vector<char> m_data;
+};
+
+/*
+ * Reads plain values from a message in the order they were written. Reading
+ * past the end fails and leaves the values untouched.
+ */
+class MessageReader
+{
+	public:
+		explicit MessageReader(std::vector<char> const& message) : m_data(message) {}
+
+		template <class T>
+		bool get(T* value) { return get(value, 1); }
+
+		template <class T>
+		bool get(T* values, std::size_t count)
+		{
+			if (count > (m_data.size() - m_offset) / sizeof(T))
+			{
+				return false;
+			}
+			if (count > 0)
+			{
+				std::memcpy(values, m_data.data() + m_offset, count * sizeof(T));
+			}
+			m_offset += count * sizeof(T);
+			return true;
+		}
+
+		bool at_end() const { return m_offset == m_data.size(); }
+
+	private:
+		std::vector<char> const& m_data;
+		std::size_t              m_offset = 0;
+};
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <random>
+#include <cglib/core/random.h>
 
 /*
  * Thread-local data.
@@ -9,24 +9,48 @@
  * such as the random number generator, need to be thread-local
  * to avoid synchronization.
  *
+ * Random numbers are counter-based (see random.h): the renderer calls
+ * begin_pixel() before each pixel, and the n-th call to rand() for that
+ * pixel always returns the same number, regardless of the thread.
+ *
  * You can add additional thread-local data if you would like to.
  */
 struct ThreadLocalData
 {
 	// Random number generation.
-	std::mt19937                          rng;
-	std::uniform_real_distribution<float> dist;
-	
+	std::uint32_t rng_key = 0;
+	std::uint32_t rng_dim = 0;
+
+	// The sample index passed to begin_pixel(). Progressive rendering
+	// renders pass n of a pixel with sample index n.
+	int sample = 0;
+
 	ThreadLocalData() {}
 
 	virtual void initialize(int threadId) final
 	{
-		rng.seed(8890 + threadId);
+		rng_key = pcg_hash(8890 + threadId);
+		rng_dim = 0;
+		sample  = 0;
+	}
+
+	// Start the random sequence of the given pixel and sample.
+	inline void begin_pixel(int x, int y, int sample_index = 0)
+	{
+		rng_key = random_key(x, y, sample_index);
+		rng_dim = 0;
+		sample  = sample_index;
 	}
 
 	inline float rand()
 	{
-		return dist(rng);
+		return random_float(rng_key, rng_dim++);
 	}
-};
 
+	// Fill values with the next count random numbers.
+	inline void rand(float* values, int count)
+	{
+		random_floats(rng_key, rng_dim, values, count);
+		rng_dim += count;
+	}
+};
@@ -2,22 +2,110 @@
 
 /*
  * A very simple thread pool. It runs a given number of jobs concurrently with a fixed thread budget.
+ *
+ * The worker threads are created once and live as long as the pool. Between
+ * two calls to run() they are parked on a condition variable, so restarting a
+ * frame only has to publish a new kernel and wake them up.
+ *
+ * Scheduling is done by work stealing: every worker owns a deque of tasks,
+ * pushes and pops at its bottom end, and steals from the top end of a random
+ * other worker when it runs out of work. The jobs of run() are handed out as
+ * contiguous ranges that are split lazily, and kernels can fork nested work
+ * with spawn() and join it with sync().
  */
 
 #include <cglib/core/thread_local_data.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <sstream>
+#include <string>
+#include <typeinfo>
+
+/*
+ * Placement of the worker threads of a pool onto CPUs.
+ *
+ * - NONE:     let the operating system schedule the workers.
+ * - COMPACT:  fill the CPUs of one NUMA node before moving on to the next.
+ * - SCATTER:  distribute workers round-robin over the NUMA nodes.
+ * - EXPLICIT: worker i runs on cpus[i % cpus.size()].
+ *
+ * Pinning is only supported on Linux and silently ignored elsewhere.
+ */
+struct ThreadAffinity
+{
+	enum Policy { NONE, COMPACT, SCATTER, EXPLICIT };
+
+	Policy           policy = NONE;
+	std::vector<int> cpus;
+
+	// Parse "none", "compact", "scatter" or a cpu list such as "0,2,4-7".
+	bool parse(std::string const& str);
+
+	// The cpus to assign to workers 0, 1, 2, ... in order (wraps around).
+	// Empty if workers should not be pinned.
+	std::vector<int> cpu_order() const;
+};
 
 class ThreadPool
 {
 	public:
-		ThreadPool(unsigned max_threads = -1);
+		/*
+		 * A set of tasks forked with spawn(). Call sync() on the group before
+		 * it goes out of scope, also when the caller's own work throws.
+		 */
+		class TaskGroup
+		{
+			public:
+				TaskGroup() : m_pending(0), m_failed(false) {}
+				~TaskGroup();
+
+				TaskGroup(TaskGroup const&) = delete;
+				TaskGroup& operator=(TaskGroup const&) = delete;
+
+			private:
+				friend class ThreadPool;
+				std::atomic<int> m_pending;
+				// The first exception thrown by a task of the group.
+				std::atomic<bool>  m_failed;
+				std::exception_ptr m_exception;
+		};
+
+		/*
+		 * Scheduling classes for submit().
+		 *
+		 * - INTERACTIVE: picked before any other work whenever a worker
+		 *                looks for its next task, so at the latest after the
+		 *                job it is running. Tasks forked with spawn() only
+		 *                come first within sync().
+		 * - NORMAL:      every normal_interleave-th task a worker picks is a
+		 *                submitted one if any is queued, so they progress
+		 *                during run() batches; otherwise picked once the
+		 *                worker's own deque is empty.
+		 * - BACKGROUND:  only started while no other work is queued and no
+		 *                run() batch is in flight, and never on all workers
+		 *                at once. A started task is not interrupted, so split
+		 *                long background work into small pieces.
+		 */
+		enum { normal_interleave = 8 };
+
+		enum Priority
+		{
+			PRIORITY_INTERACTIVE,
+			PRIORITY_NORMAL,
+			PRIORITY_BACKGROUND,
+			PRIORITY_COUNT
+		};
+
+		ThreadPool(unsigned max_threads = -1, ThreadAffinity const& affinity = ThreadAffinity());
 		~ThreadPool();
 		bool done() const;
 		void terminate();
@@ -46,16 +134,41 @@ class ThreadPool
             return (num_jobs() == 0 || float(jobs_done())/num_jobs() > 0.1);
         }
 
-		void
-		wait()
+		// Block until all workers have finished the current batch of jobs.
+		void wait();
+
+		// Fork a task into the given group. When called from a worker, the task
+		// is pushed onto that worker's own deque.
+		void spawn(TaskGroup& group, std::function<void()> task);
+
+		// Join all tasks of the group. Workers keep executing other tasks
+		// while they wait, other threads block. Once all tasks are done,
+		// rethrows the first exception one of them threw.
+		void sync(TaskGroup& group);
+
+		// Run fn on one of the workers, independently of run() batches:
+		// terminate() and wait() do not affect submitted tasks, and the pool
+		// only shuts down once all of them are done. Exceptions thrown by fn
+		// are delivered through the future.
+		// Do not block on the future from within a worker, use spawn() and
+		// sync() there instead.
+		template <class F>
+		auto submit(Priority priority, F fn) -> std::future<decltype(fn())>;
+
+		inline int num_threads() const
 		{
-			for(auto &i: m_threads) {
-				if(i->joinable()) {
-						i->join();
-				}
-			}
+			return static_cast<int>(m_threads.size());
 		}
 
+		// The index of the calling worker thread of this pool, or -1.
+		int current_thread_id() const;
+
+		// The pool used by parallel_for and friends when none is given.
+		// Falls back to a pool with one thread per hardware thread.
+		static ThreadPool& get_active();
+		// Once this pool is destroyed, the pool active before is again.
+		void set_active();
+
 		void poll_exceptions()
 		{
 			if (m_hasException.load())
@@ -75,6 +188,19 @@ class ThreadPool
 		bool kill_at_timeout(int timeout);
 
 	private:
+		struct Task;
+		class TaskDeque;
+
+		void worker_main(int threadId);
+		void push_task(Task* task);
+		void submit_internal(Priority priority, std::function<void()> fn);
+		bool has_work() const;
+		bool background_allowed() const;
+		Task* pop_submitted(Priority priority);
+		Task* find_task(int threadId, bool foreground_only = false);
+		void execute(Task* task);
+		void run_range(int begin, int end);
+		void record_exception(std::string const& what);
 		void run_internal(
 			int num_jobs,
 			std::function<void(int, ThreadLocalData* tld, std::atomic<bool>&)> kernel,
@@ -82,16 +208,45 @@ class ThreadPool
 		);
 
 	private:
+		static ThreadPool*                            active_pool;
+
 		std::vector<std::unique_ptr<std::thread>>     m_threads;
 		std::function<void(int, ThreadLocalData*, std::atomic<bool>&)>    m_kernel;
 		std::vector<std::unique_ptr<ThreadLocalData>> m_tld;
+		std::vector<unsigned>                         m_tldBatch;
+		std::vector<int>                              m_cpus;
+		std::function<void(int, std::unique_ptr<ThreadLocalData>& tld)> m_tldAlloc;
 		std::atomic<int>                              m_numJobs;
-		std::atomic<int>                              m_currentJob;
 		std::atomic<int>                              m_jobsDone;
 		std::atomic<bool>                             m_terminate;
 		std::atomic<bool>                             m_hasException;
 		std::vector<std::string>                      m_exceptionMsg;
 		std::mutex                                    m_exceptionMutex;
+
+		// Scheduling state. The injection queue takes tasks submitted by
+		// threads that are not workers of this pool.
+		std::vector<std::unique_ptr<TaskDeque>>       m_deques;
+		std::deque<Task*>                             m_injected;
+		TaskGroup                                     m_batch;
+		unsigned                                      m_batchId;
+		std::atomic<int>                              m_numQueued;
+		std::atomic<int>                              m_numInjected;
+		std::atomic<int>                              m_numSleeping;
+
+		// Tasks from submit(), one FIFO per priority, protected by m_mutex.
+		std::deque<Task*>                             m_submitted[PRIORITY_COUNT];
+		std::atomic<int>                              m_numSubmitted[PRIORITY_COUNT];
+		std::atomic<int>                              m_numBackground;
+		TaskGroup                                     m_submittedGroup;
+
+		// Parking state, protected by m_mutex.
+		std::mutex                                    m_mutex;
+		std::condition_variable                       m_wakeup;
+		std::condition_variable                       m_idle;
+		bool                                          m_shutdown;
+
+		// Made active again on destruction, see set_active().
+		ThreadPool*                                   m_previousActive;
 };
 
 template <class TLD>
@@ -105,12 +260,26 @@ inline void ThreadPool::run(
 
 	run_internal(num_jobs, kernel, [](int threadId, std::unique_ptr<ThreadLocalData>& tld) 
 		{
-			tld.reset(new TLD());
+			// Reuse the allocation of the previous run if it has the right type.
+			if (!tld || typeid(*tld) != typeid(TLD))
+			{
+				tld.reset(new TLD());
+			}
 			tld->initialize(threadId);
 		}
 	);
 }
 
+template <class F>
+inline auto ThreadPool::submit(Priority priority, F fn) -> std::future<decltype(fn())>
+{
+	using Result = decltype(fn());
+	auto job = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+	std::future<Result> result = job->get_future();
+	submit_internal(priority, [job]() { (*job)(); });
+	return result;
+}
+
 template <>
 inline void ThreadPool::run<void>(
 	int num_jobs, 
@@ -4,6 +4,7 @@
 #include <cglib/rt/object.h>
 #include <cglib/rt/epsilon.h>
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <algorithm>
@@ -21,6 +22,12 @@ public:
 	 */
 	enum { MAX_TRIANGLES_IN_LEAF = 4 };
 
+	/*
+	 * The binned SAH builder sorts triangle centers into this many bins
+	 * per axis.
+	 */
+	enum { SAH_BINS = 16 };
+
 	/*
 	 * A BVH node.
 	 *
@@ -37,6 +44,50 @@ public:
 		int num_triangles = 0;
 	};
 
+	/*
+	 * A triangle prepared for intersection tests, see
+	 * intersect_triangle_edges().
+	 */
+	struct LeafTriangle {
+		glm::vec3 v0;
+		glm::vec3 edge1;
+		glm::vec3 edge2;
+	};
+
+	/*
+	 * A 32 byte copy of a Node, stored in depth first order so that the
+	 * left child of an inner node directly follows it. For inner nodes
+	 * (count 0), right_child is the index of the right child and axis the
+	 * axis along which the children are separated best. Leaves hold count
+	 * triangles starting at triangle_indices[first_triangle].
+	 */
+	struct alignas(32) CompactNode {
+		float min[3];
+		union {
+			int right_child;
+			int first_triangle;
+		};
+		float max[3];
+		std::uint16_t count;
+		std::uint16_t axis;
+	};
+
+	/*
+	 * A node of the 4-wide BVH collapsed from the binary one. The bounds of
+	 * the children are stored per coordinate, so that one SIMD slab test
+	 * covers all of them. Child k is an inner node wide_nodes[child[k]] if
+	 * count[k] is 0, a leaf with count[k] triangles starting at
+	 * triangle_indices[child[k]] if count[k] > 0, and unused if count[k]
+	 * is -1.
+	 */
+	struct alignas(16) WideNode {
+		enum { WIDTH = 4 };
+		float min_x[WIDTH], min_y[WIDTH], min_z[WIDTH];
+		float max_x[WIDTH], max_y[WIDTH], max_z[WIDTH];
+		int   child[WIDTH];
+		int   count[WIDTH];
+	};
+
 	/*
 	 * The triangle soup for which this BVH is built.
 	 */
@@ -47,15 +98,55 @@ public:
 	 */
 	std::vector<int> triangle_indices;
 
+	/*
+	 * The triangles triangle_indices refers to, in the same order, so that
+	 * the triangles of a leaf are contiguous. Normals, texture coordinates
+	 * and materials are only needed for the nearest hit and stay in
+	 * triangle_soup.
+	 */
+	std::vector<LeafTriangle> leaf_triangles;
+
 	/*
 	 * The nodes contained in this BVH.
 	 */
 	std::vector<Node> nodes;
 
+	/*
+	 * The compact BVH, built from nodes after every build. Empty if it
+	 * would be too deep for the traversal stack.
+	 */
+	std::vector<CompactNode> compact_nodes;
+
+	/*
+	 * The wide BVH, built from nodes after every build. Empty if it would
+	 * be too deep for the traversal stack.
+	 */
+	std::vector<WideNode> wide_nodes;
+
+	/*
+	 * Time spent in the constructor building the hierarchy.
+	 */
+	double build_time_ms = 0.0;
+
+	/*
+	 * The RaytracingParameters::BVHBuilder the hierarchy was built with.
+	 */
+	int builder = 0;
+
+	/*
+	 * The RaytracingParameters::BVHTraversal used by intersect().
+	 */
+	int traversal = 0;
+
 	/* 
 	 * Construct (and build) a new BVH for the given triangle soup.
 	 */
-	BVH(const TriangleSoup &triangle_soup_);
+	BVH(const TriangleSoup &triangle_soup_, int builder_ = 0);
+
+	/*
+	 * Build the hierarchy again with the given RaytracingParameters::BVHBuilder.
+	 */
+	void rebuild(int builder_);
     
 	/*
 	 * Intersect the given ray with this bvh.
@@ -78,8 +169,15 @@ public:
 	double surface_area_heuristic(int node_idx) const;
 
 	void build_bvh(int node_idx, int first_triangle_idx, int num_triangles, int depth);
+	void build_bvh_sah();
+	void build_bvh_linear(bool restructure);
+	void build_leaf_triangles();
+	void build_compact_bvh();
+	void build_wide_bvh();
 	int reorder_triangles_median(int first_triangle_idx, int num_triangles, int axis);
 	bool intersect_recursive(const Ray &ray, int idx, float *t_max, Intersection* isect) const;
+	bool intersect_compact(const Ray &ray, float *t_max, Intersection* isect) const;
+	bool intersect_wide(const Ray &ray, float *t_max, Intersection* isect) const;
 
 	/*
 	 * Used for debug visualization. Maps the number of AABBs that can be
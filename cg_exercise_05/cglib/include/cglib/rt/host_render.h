@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cglib/core/gui.h>
+#include <cglib/core/profiler.h>
 #include <cglib/core/thread_local_data.h>
 #include <cglib/core/thread_pool.h>
 #include <cglib/core/timer.h>
@@ -11,12 +12,14 @@
 #include <cglib/rt/render_data.h>
 
 #include <cglib/core/assert.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <iostream>
-#include <mutex>
-
-static std::mutex mutex;
+#include <memory>
+#include <string>
 
 struct RenderData;
 
@@ -34,18 +37,330 @@ class HostRender
 		 */
 		typedef std::function<glm::vec3(int, int, RaytracingContext const&, RenderData &)> PixelFunc;
 
+		/*
+		 * The pixels [x0, x1) x [y0, y1) of the frame buffer, handed to a
+		 * tile kernel. set_pixel() adds the color of pass `pass` to the
+		 * pixel and updates the frame buffer. Call 
+		 * ThreadLocalData::begin_pixel(x, y, pass) before shading a pixel,
+		 * and count_rays() after it to include its rays in the statistics.
+		 *
+		 * Preview frames have a scale > 1: only the pixels 
+		 * (x0 + i * scale, y0 + j * scale) are shaded, and set_pixel() fills
+		 * the whole scale x scale block with their color.
+		 *
+		 * If the launch keeps a G-buffer, gbuffer_sample() returns the entry
+		 * of a pixel, to be passed to trace_recursive in RenderData.
+		 */
+		class RenderTile
+		{
+			public:
+				int const x0, y0, x1, y1;
+				int const pass;
+				int const scale;
+				int const gbuffer_frame;
+
+				int width()  const { return x1 - x0; }
+				int height() const { return y1 - y0; }
+
+				inline void set_pixel(int x, int y, glm::vec3 const& color)
+				{
+					if (scale > 1)
+					{
+						set_block(x, y, color);
+						return;
+					}
+					int const i = y * m_stride + x;
+					m_sum[i] += color;
+					m_count[i]++;
+					m_image.setPixel(x, y, glm::vec4(m_sum[i] / float(m_count[i]), 1.f));
+				}
+
+				inline GBufferSample* gbuffer_sample(int x, int y) const
+				{
+					return m_gbuffer ? m_gbuffer + y * m_stride + x : nullptr;
+				}
+
+				// Rays cast for the pixels of this tile.
+				std::uint64_t num_rays[RenderData::RAY_TYPE_COUNT] = {};
+
+				inline void count_rays(RenderData const& data)
+				{
+					for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+					{
+						num_rays[i] += data.num_rays[i];
+					}
+				}
+
+			private:
+				friend class HostRender;
+				RenderTile(Image* fb, glm::vec3* sum, int* count, int x0_, int y0_, int x1_, int y1_, int pass_, 
+						int scale_, GBufferSample* gbuffer, int gbuffer_frame_) :
+					x0(x0_), y0(y0_), x1(x1_), y1(y1_), pass(pass_), scale(scale_), gbuffer_frame(gbuffer_frame_),
+					m_image(fb, x0_, y0_, x1_, y1_), m_sum(sum), m_count(count), m_gbuffer(gbuffer), 
+					m_stride(fb->getWidth())
+				{}
+
+				// Previews are not accumulated, the next full resolution
+				// frame starts over.
+				inline void set_block(int x, int y, glm::vec3 const& color)
+				{
+					int const bx1 = std::min(x + scale, x1);
+					int const by1 = std::min(y + scale, y1);
+					for (int by = y; by < by1; ++by)
+					{
+						for (int bx = x; bx < bx1; ++bx)
+						{
+							int const i = by * m_stride + bx;
+							m_sum[i]   = color;
+							m_count[i] = 1;
+							m_image.setPixel(bx, by, glm::vec4(color, 1.f));
+						}
+					}
+				}
+
+				ImageTile      m_image;
+				glm::vec3*     m_sum;
+				int*           m_count;
+				GBufferSample* m_gbuffer;
+				int            m_stride;
+		};
+
+		/*
+		 * Render with a per-pixel function. This is an adapter on top of
+		 * run_tiles() that resolves the render mode once per tile.
+		 */
 		static int run(RaytracingContext& context, 
 				       PixelFunc const& render_pixel, 
 					   int kill_timeout_seconds = 0,
 					   std::function<void()> const& render_overlay = []() {} );
 
+		/*
+		 * Render with a tile kernel, called as
+		 *
+		 *   kernel(RenderTile& tile, ThreadLocalData& tld, std::atomic<bool> const& terminate)
+		 *
+		 * for every tile. It must shade all pixels of the tile, and should
+		 * return early once terminate is set. The kernel is a template
+		 * parameter, so its per-pixel work is inlined into the tile loop.
+		 */
+		template <class TileKernel>
+		static int run_tiles(RaytracingContext& context, 
+				       TileKernel const& kernel, 
+					   int kill_timeout_seconds = 0,
+					   std::function<void()> const& render_overlay = []() {} );
+
+		/*
+		 * Call build, which creates or refreshes scenes, with a thread pool
+		 * configured like the render pool. The pool is gone again once
+		 * build returns, so that no threads outlive it next to the render
+		 * pool or in forked worker processes.
+		 */
+		static void build_scenes(Parameters const& params, std::function<void()> const& build);
+
+		/*
+		 * Creates the scene with the given name, or returns nullptr if there
+		 * is no such scene.
+		 */
+		typedef std::function<std::shared_ptr<Scene>(std::string const& name)> SceneFactory;
+
+		/*
+		 * Headless benchmark of the scene params.benchmark_scene. Loads the
+		 * scene with create_scene, renders params.benchmark_warmup untimed
+		 * and params.benchmark_repeat timed frames without GUI or image output,
+		 * and writes a JSON report to params.benchmark_output (or stdout):
+		 * frame times, scene load and BVH build time, Mrays/s per ray type
+		 * and the utilization of every worker thread.
+		 */
+		static int run_benchmark(RaytracingContext& context, 
+					   PixelFunc const& render_pixel, 
+					   SceneFactory const& create_scene);
+
 	private:
-		typedef std::function<glm::vec3(int, int, RaytracingContext const&, ThreadLocalData*)> PixelFuncRaw;
-		static void generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
-		static int run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel, 
+
+		/*
+		 * The tiles of the current launch, in render order. Workers write
+		 * their tile straight into the frame buffer and then set its done
+		 * flag with release semantics. A thread that observes the flag
+		 * through is_done() also observes all pixels of the tile.
+		 */
+		struct Tiles
+		{
+			int                                  size = 0;
+			std::vector<glm::ivec2>              idx;
+			std::unique_ptr<std::atomic<bool>[]> done;
+
+			// If not empty, launches render only these tiles, and pass 0
+			// does not clear the tiles rendered before. Used by workers of
+			// distributed rendering.
+			std::vector<glm::ivec2>              batch;
+
+			// Completed tiles of the current launch that have been shown.
+			// Only used by the thread displaying the frame buffer.
+			std::vector<char>                    displayed;
+
+			// Automatic tile size, and the time spent in completed tiles
+			// of the first frame rendered with it.
+			int                                  auto_size = 0;
+			bool                                 tuned = false;
+			std::atomic<long long>               busy_us { 0 };
+
+			// Statistics of completed tiles per worker thread. Every entry
+			// is only written by its worker.
+			struct alignas(64) WorkerStats
+			{
+				long long     busy_us = 0;
+				int           tiles = 0;
+				std::uint64_t num_rays[RenderData::RAY_TYPE_COUNT] = {};
+			};
+			std::vector<WorkerStats>             workers;
+
+			int count() const { return static_cast<int>(idx.size()); }
+			bool is_done(int tile) const { return done[tile].load(std::memory_order_acquire); }
+		};
+
+		/*
+		 * Progressive rendering state. Pass n renders every pixel once more
+		 * with sample index n, and the frame buffer shows the average of all
+		 * passes a pixel has received so far.
+		 */
+		struct Accumulation
+		{
+			int                    pass = 0;
+			// Pixel block size of the current frame, > 1 for previews.
+			int                    scale = 1;
+			std::vector<glm::vec3> sum;
+			std::vector<int>       count;
+
+			// Primary hits of the current G-buffer frame. Every pass 0
+			// launch starts a new frame, unless reshade is set: then it
+			// only reshades the hits recorded so far. Pixels without a hit
+			// in the current frame are traced and recorded.
+			std::vector<GBufferSample> gbuffer;
+			int                        gbuffer_frame = 0;
+			bool                       gbuffer_active = false;
+			bool                       reshade = false;
+		};
+
+		// Starts rendering pass `pass` into the frame buffer. Type-erased once
+		// per launch, the tile kernel itself is not.
+		typedef std::function<void(Image*, ThreadPool&, RaytracingContext const*, Tiles*, Accumulation*, int)> LaunchFunc;
+
+		static void generate_tile_idx(int order, int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx);
+		static int choose_tile_size(RaytracingParameters const& params, int width, int height, int num_threads, Tiles* tiles);
+		static int run_interactive(RaytracingContext& context, LaunchFunc const& launch, 
 			std::function<void()> const& render_overlay = []() {} );
 		static int run_noninteractive(RaytracingContext& context, 
-			PixelFuncRaw const& render_pixel,
+			LaunchFunc const& launch,
 			int kill_timeout_seconds);
-		static void launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, std::vector<glm::ivec2>* tile_idx, PixelFuncRaw render_pixel);
+		// Renders the frames of params.sequence_output. Frame N + 1 renders
+		// while frame N is written.
+		static int run_sequence(RaytracingContext& context, 
+			LaunchFunc const& launch);
+		// Distributed noninteractive rendering, see Parameters::Distribution.
+		static int run_coordinator(RaytracingContext& context, 
+			LaunchFunc const& launch,
+			int kill_timeout_seconds);
+		static int run_worker(RaytracingContext& context, 
+			LaunchFunc const& launch,
+			std::string const& address,
+			bool load_scene);
+		static ThreadAffinity thread_affinity(Parameters const& params);
+		static bool can_accumulate(RaytracingParameters const& params);
+		static bool desaturate_on_display(RaytracingParameters const& params);
+		static bool can_use_gbuffer(RaytracingParameters const& params);
+		static int choose_pixel_scale(RaytracingParameters const& params, float us_per_pixel);
+		static void collect_dirty_tiles(int width, int height, Tiles* tiles, std::vector<glm::ivec4>* dirty);
+		static void begin_trace(Parameters const& params);
+		static void end_trace(Parameters const& params);
+		static void prepare_launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, Tiles* tiles, 
+			Accumulation* accumulation, int pass);
+		template <class TileKernel>
+		static void launch(Image* fb, ThreadPool& thread_pool, RaytracingContext const* context, Tiles* tiles, 
+			Accumulation* accumulation, int pass, TileKernel const& kernel);
 };
+
+// -----------------------------------------------------------------------------
+
+template <class TileKernel>
+int HostRender::run_tiles(RaytracingContext& context, 
+		TileKernel const& kernel, 
+		int kill_timeout_seconds,
+		std::function<void()> const& render_overlay)
+{
+	LaunchFunc const launch_kernel = [&kernel](Image* fb, ThreadPool& thread_pool, 
+		RaytracingContext const* ctx, Tiles* tiles, Accumulation* accumulation, int pass)
+		{
+			launch(fb, thread_pool, ctx, tiles, accumulation, pass, kernel);
+		};
+
+	if (context.params.interactive)
+	{
+		return run_interactive(context, launch_kernel, render_overlay);
+	}
+	else
+	{
+		return run_noninteractive(context, launch_kernel, kill_timeout_seconds);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+template <class TileKernel>
+void HostRender::launch(Image* fb, 
+		ThreadPool& thread_pool, 
+		RaytracingContext const* context, 
+		Tiles* tiles,
+		Accumulation* accumulation,
+		int pass,
+		TileKernel const& kernel)
+{
+	prepare_launch(fb, thread_pool, context, tiles, accumulation, pass);
+
+	int const width     = fb->getWidth();
+	int const height    = fb->getHeight();
+	int const tile_size = tiles->size;
+	ThreadPool* const pool = &thread_pool;
+
+	// Launch threads.
+	thread_pool.run<ThreadLocalData>(tiles->count(), 
+			// The actual kernel.
+			[=](int tile, ThreadLocalData* tld, std::atomic<bool>& terminate)
+			{
+				glm::ivec2 const idx = tiles->idx[tile];
+				int const baseX = std::max<int>(idx[0] * tile_size, 0);
+				int const endX  = std::min<int>(baseX + tile_size, width);
+
+				int const baseY = std::max<int>(idx[1] * tile_size, 0);
+				int const endY  = std::min<int>(baseY + tile_size, height);
+
+				auto const start = std::chrono::high_resolution_clock::now();
+				RenderTile render_tile(fb, accumulation->sum.data(), accumulation->count.data(),
+					baseX, baseY, endX, endY, pass, accumulation->scale,
+					accumulation->gbuffer_active ? accumulation->gbuffer.data() : nullptr,
+					accumulation->gbuffer_frame);
+				{
+					CG_PROFILE_TRACE_SCOPE(SCOPE_TILE, tile);
+					kernel(render_tile, *tld, terminate);
+				}
+				if (terminate.load())
+					return;
+
+				auto const end = std::chrono::high_resolution_clock::now();
+				long long const busy_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+				tiles->busy_us.fetch_add(busy_us, std::memory_order_relaxed);
+
+				int const worker = pool->current_thread_id();
+				if (worker >= 0)
+				{
+					Tiles::WorkerStats& stats = tiles->workers[worker];
+					stats.busy_us += busy_us;
+					stats.tiles++;
+					for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+					{
+						stats.num_rays[i] += render_tile.num_rays[i];
+					}
+				}
+				tiles->done[tile].store(true, std::memory_order_release);
+			}
+	);
+}
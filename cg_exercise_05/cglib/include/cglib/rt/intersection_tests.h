@@ -3,20 +3,22 @@
 #include <glm/glm.hpp>
 #include <cglib/core/assert.h>
 
+/*
+ * Like intersect_triangle(), for a triangle given by its first vertex and
+ * the edges edge1 = v1 - v0 and edge2 = v2 - v0, which can be computed
+ * once in advance.
+ */
 template<bool enable_early_out = true>
 inline bool
-intersect_triangle(
+intersect_triangle_edges(
         glm::vec3 const& ray_origin,
         glm::vec3 const& ray_direction,
 		glm::vec3 const& v0, 
-		glm::vec3 const& v1, 
-		glm::vec3 const& v2, 
+		glm::vec3 const& edge1, 
+		glm::vec3 const& edge2, 
         glm::vec3 & bary,
 		float &dist)
 {
-	const glm::vec3 edge1 = v1 - v0;
-	const glm::vec3 edge2 = v2 - v0;
-
 	const glm::vec3 pvec = glm::cross(ray_direction, edge2);
 
 	const float det = glm::dot(edge1, pvec);
@@ -53,6 +55,21 @@ intersect_triangle(
 	}
 }
 
+template<bool enable_early_out = true>
+inline bool
+intersect_triangle(
+        glm::vec3 const& ray_origin,
+        glm::vec3 const& ray_direction,
+		glm::vec3 const& v0, 
+		glm::vec3 const& v1, 
+		glm::vec3 const& v2, 
+        glm::vec3 & bary,
+		float &dist)
+{
+	return intersect_triangle_edges<enable_early_out>(ray_origin, ray_direction,
+		v0, v1 - v0, v2 - v0, bary, dist);
+}
+
 inline bool 
 intersect_sphere(
     glm::vec3 const& ray_origin,    // starting point of the ray
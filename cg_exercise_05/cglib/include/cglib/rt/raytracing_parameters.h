@@ -34,6 +34,7 @@ class RaytracingParameters : public Parameters
 			DUDV,
 			BVH_TIME,
 			AABB_INTERSECT_COUNT,
+			SAMPLE_COUNT,
 			RENDER_MODE_COUNT
 		};
 
@@ -42,6 +43,7 @@ class RaytracingParameters : public Parameters
 			"du dv",
 			"BVH Traversal Time",
 			"AABB Intersection Count",
+			"Sample Count",
 		};
 
 		enum Exercise {
@@ -100,17 +102,78 @@ class RaytracingParameters : public Parameters
 		float ray_epsilon       = 7.f*1e-3f;
 		float fovy              = 45.0f;
 
+		// Place pixel samples with the low-discrepancy sequence of
+		// sample(), otherwise independently at random.
 		bool stratified = true;
 
 		bool normal_mapping = false;
 		bool transform_objects = true;
 		int spp = 1; // number of samples per pixel
 
+		// Adaptive sampling: keep taking batches of spp samples until the
+		// relative standard error of the pixel luminance drops below
+		// adaptive_threshold, or max_spp samples have been taken.
+		bool adaptive_sampling = false;
+		float adaptive_threshold = 0.02f;
+		int max_spp = 64;
+
+		// In interactive mode, keep adding passes of spp samples per pixel
+		// while the view does not change.
+		bool progressive = true;
+		int max_passes = 256;
+
+		// In interactive mode, shade only one pixel per block of up to
+		// max_pixel_scale^2 pixels while the camera moves, so that frames
+		// keep up with the fps parameter. Full resolution once it stops.
+		bool dynamic_resolution = true;
+		int max_pixel_scale = 8;
+
+		// In interactive mode, keep the primary hit of every pixel so that
+		// changing the shading switches only reshades. Costs one Intersection
+		// per pixel, and applies to single sample recursive rendering.
+		bool gbuffer_cache = true;
+
 		int num_triangles = 5;
 
+		// How triangle BVHs are built, see BVH::rebuild(). Changing it
+		// rebuilds the BVHs of the scene.
+		enum BVHBuilder {
+			BVH_BUILDER_MEDIAN,
+			BVH_BUILDER_SAH,
+			BVH_BUILDER_LBVH,
+			BVH_BUILDER_TRBVH,
+			BVH_BUILDER_COUNT
+		};
+
+		const char* bvh_builder_names[BVH_BUILDER_COUNT] = {
+			"median", "sah", "lbvh", "trbvh"
+		};
+
+		int bvh_builder = BVH_BUILDER_MEDIAN;
+
+		// How rays traverse triangle BVHs: BVH::intersect_recursive() on
+		// the binary tree, BVH::intersect_compact() on its 32 byte node
+		// copy, or BVH::intersect_wide() on the 4-wide one. The default is
+		// the recursive traversal of the exercise.
+		enum BVHTraversal {
+			BVH_TRAVERSAL_RECURSIVE,
+			BVH_TRAVERSAL_COMPACT,
+			BVH_TRAVERSAL_WIDE,
+			BVH_TRAVERSAL_COUNT
+		};
+
+		const char* bvh_traversal_names[BVH_TRAVERSAL_COUNT] = {
+			"recursive", "compact", "wide"
+		};
+
+		int bvh_traversal = BVH_TRAVERSAL_RECURSIVE;
+
 		int tex_filter_mode = TextureFilterMode::TRILINEAR;
 		int tex_wrap_mode = TextureWrapMode::REPEAT;
 
 
+	protected:
+		bool derived_parse_option(std::string const& arg, std::istream& is, bool* success) override;
+
 	private:
 };
@@ -5,12 +5,34 @@
 
 struct ThreadLocalData;
 struct RaytracingContext;
+class Ray;
+
+/*
+ * The primary hit of a pixel, see HostRender. Recorded in G-buffer frame
+ * `frame`, so that a change of the shading parameters does not need to
+ * retrace the primary rays.
+ */
+struct GBufferSample
+{
+	int          frame = -1;
+	bool         hit = false;
+	Intersection isect;
+};
 
 /*
  * Rendering data that will be passed to the raytracer for each pixel
  */
 struct RenderData
 {
+	// Kinds of rays counted in num_rays.
+	enum RayType
+	{
+		RAY_PRIMARY,	// camera rays
+		RAY_SHADOW,		// visibility tests
+		RAY_SECONDARY,	// reflection and transmission rays
+		RAY_TYPE_COUNT
+	};
+
 	RenderData(
 		RaytracingContext const& context_,
 		ThreadLocalData* tld_) :
@@ -22,7 +44,16 @@ struct RenderData
 	ThreadLocalData* tld;
 	Intersection isect;
 	int num_cast_rays = 0;
+	int num_rays[RAY_TYPE_COUNT] = {};
+	int num_samples = 0;	// Camera samples taken for this pixel
 	float x = 0.0f;	// x-Coordinate of (Sub-)Pixel
 	float y = 0.0f;	// y-Coordinate of (Sub-)Pixel
 	Camera::Mode camera_mode = Camera::Mono;
+	// Specialization of trace_recursive for the current shading flags,
+	// see select_trace_kernel(). Chosen on each call if nullptr.
+	glm::vec3 (*trace_kernel)(RenderData&, Ray const&, int) = nullptr;
+	// G-buffer entry of this pixel, or nullptr. The primary ray reuses its
+	// hit if it was recorded in frame gbuffer_frame, and records it otherwise.
+	GBufferSample* gbuffer = nullptr;
+	int gbuffer_frame = 0;
 };
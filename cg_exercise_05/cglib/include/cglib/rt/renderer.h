@@ -8,6 +8,46 @@ struct RenderData;
 class Intersection;
 struct ThreadLocalData;
 class MaterialSample;
+class RaytracingParameters;
+
+/*
+ * The boolean shading switches of RaytracingParameters as a bitmask.
+ *
+ * The shading functions in renderer.cpp are specialized on these flags, so
+ * that disabled features cost nothing in the shading loop. SHADE_DYNAMIC
+ * marks the generic version, which reads the switches from the parameters.
+ */
+enum ShadingFlags : unsigned
+{
+	SHADE_SHADOWS        = 1u << 0,
+	SHADE_AMBIENT        = 1u << 1,
+	SHADE_DIFFUSE        = 1u << 2,
+	SHADE_SPECULAR       = 1u << 3,
+	SHADE_REFLECTION     = 1u << 4,
+	SHADE_TRANSMISSION   = 1u << 5,
+	SHADE_FRESNEL        = 1u << 6,
+	SHADE_DISPERSION     = 1u << 7,
+	SHADE_NORMAL_MAPPING = 1u << 8,
+	SHADE_DIFFUSE_WHITE  = 1u << 9,
+	SHADE_DYNAMIC        = 1u << 31,
+};
+
+/*
+ * The shading flags enabled in params.
+ */
+unsigned shading_flags(RaytracingParameters const& params);
+
+/*
+ * A version of trace_recursive.
+ */
+typedef glm::vec3 (*TraceFunc)(RenderData &data, Ray const& ray, int depth);
+
+/*
+ * Returns trace_recursive specialized for the given shading flags, or the
+ * generic version if there is no specialization for this combination.
+ * Select once per frame and store the result in RenderData::trace_kernel.
+ */
+TraceFunc select_trace_kernel(unsigned flags);
 
 /*
  * reflect the vector v at the normal vector n. v points "away from n"
@@ -134,7 +174,8 @@ glm::vec3 handle_transmissive_material(
 	glm::vec3 const& eta_of_channel);	// relative refraction index of red, green and blue color channel
 
 /*
- * Call this function to start or continue one path segment during recursive raytracing
+ * Call this function to start or continue one path segment during recursive raytracing.
+ * Uses data.trace_kernel if it is set.
  */
 glm::vec3 trace_recursive(
 	RenderData & data,
@@ -1,10 +1,44 @@
 #pragma once
 
+#include <cglib/core/random.h>
+
 #include <vector>
+#include <cmath>
+#include <cstdint>
 #include <glm/glm.hpp>
 
 struct ThreadLocalData;
 
+/*
+ * Running mean and variance of a sequence of values (Welford's algorithm).
+ */
+struct RunningVariance
+{
+	int   count = 0;
+	float mean  = 0.0f;
+	float m2    = 0.0f;
+
+	void add(float value)
+	{
+		count++;
+		float const delta = value - mean;
+		mean += delta / float(count);
+		m2   += delta * (value - mean);
+	}
+
+	// Unbiased sample variance.
+	float variance() const
+	{
+		return (count > 1) ? m2 / float(count - 1) : 0.0f;
+	}
+
+	// Estimated standard deviation of the mean.
+	float standard_error() const
+	{
+		return (count > 0) ? std::sqrt(variance() / float(count)) : 0.0f;
+	}
+};
+
 void
 generate_stratified_samples(
 		std::vector<glm::vec2> *generated_samples,
@@ -18,3 +52,102 @@ generate_random_samples(
 		int grid_x,
 		int grid_y,
 		ThreadLocalData *tld);
+
+// -----------------------------------------------------------------------------
+
+/*
+ * Stateless low-discrepancy samples, for any number of samples per pixel.
+ *
+ * sample(pixel, index, dim) is dimension dim of sample index of the given
+ * pixel. It needs no state and no memory besides two constant tables.
+ * Dimensions come in pairs (2k, 2k + 1) forming a 2D Sobol sequence that is
+ * Owen scrambled and shuffled per pixel and pair, see Burley, "Practical
+ * Hash-based Owen Scrambling", JCGT 2020. Every prefix of the samples of a
+ * pixel is well distributed, prefixes of power of two length are
+ * stratified, and different pairs are uncorrelated.
+ *
+ * Each kind of random decision uses its own pair.
+ */
+enum SampleDimension
+{
+	SAMPLE_DIM_PIXEL      = 0, // Position in the pixel (2D).
+	SAMPLE_DIM_DISPERSION = 2, // Wavelength (1D).
+	SAMPLE_DIM_LIGHT      = 4, // Point on a light source (2D).
+	SAMPLE_DIM_COUNT      = 6,
+};
+
+// Direction numbers of the first two Sobol dimensions: the van der Corput
+// sequence and the one of the primitive polynomial x + 1.
+struct SobolMatrices
+{
+	std::uint32_t v[2][32];
+};
+
+constexpr SobolMatrices make_sobol_matrices()
+{
+	SobolMatrices m = {};
+	for (int i = 0; i < 32; ++i)
+	{
+		m.v[0][i] = 1u << (31 - i);
+		m.v[1][i] = i == 0 ? 1u << 31 : m.v[1][i - 1] ^ (m.v[1][i - 1] >> 1);
+	}
+	return m;
+}
+
+inline constexpr SobolMatrices sobol_matrices = make_sobol_matrices();
+
+inline std::uint32_t sobol(std::uint32_t index, int dim)
+{
+	std::uint32_t x = 0;
+	for (int bit = 0; index; ++bit, index >>= 1)
+	{
+		x ^= (index & 1u) ? sobol_matrices.v[dim][bit] : 0u;
+	}
+	return x;
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the bits of x: every bit is flipped depending on a
+// hash of the more significant bits only.
+inline std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed)
+{
+	// Laine-Karras style permutation of the reversed bits.
+	x = reverse_bits(x);
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1u;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return reverse_bits(x);
+}
+
+inline std::uint32_t sample_seed(glm::ivec2 pixel, std::uint32_t dim)
+{
+	return pcg_hash(random_key(pixel.x, pixel.y, 0) ^ ((dim >> 1) * 0x9e3779b9u));
+}
+
+// Dimension dim of sample index of the pixel, in [0, 1).
+inline float sample(glm::ivec2 pixel, std::uint32_t index, std::uint32_t dim)
+{
+	std::uint32_t const seed = sample_seed(pixel, dim);
+	std::uint32_t const i    = nested_uniform_scramble(index, seed);
+	return random_to_float(nested_uniform_scramble(sobol(i, dim & 1u), pcg_hash(seed + (dim & 1u))));
+}
+
+// Dimensions dim and dim + 1 of sample index of the pixel. dim is even.
+inline glm::vec2 sample_2d(glm::ivec2 pixel, std::uint32_t index, std::uint32_t dim)
+{
+	std::uint32_t const seed = sample_seed(pixel, dim);
+	std::uint32_t const i    = nested_uniform_scramble(index, seed);
+	return glm::vec2(
+		random_to_float(nested_uniform_scramble(sobol(i, 0), pcg_hash(seed))),
+		random_to_float(nested_uniform_scramble(sobol(i, 1), pcg_hash(seed + 1u))));
+}
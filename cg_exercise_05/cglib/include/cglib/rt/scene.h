@@ -41,6 +41,11 @@ public:
 	virtual void init_camera(RaytracingParameters& params) {}
 	virtual void set_active_camera();
 
+	// Rebuild the BVHs of the scene if they were built with another
+	// builder than params.bvh_builder, and switch them to
+	// params.bvh_traversal.
+	void rebuild_bvhs(RaytracingParameters const& params);
+
 	virtual const char *get_name() { return "unknown"; }
 };
 
@@ -3,14 +3,20 @@
 #include <cglib/core/camera.h>
 #include <cglib/core/image.h>
 #include <cglib/core/gui.h>
+#include <cglib/core/profiler.h>
 #include <cglib/imgui/imgui.h>
 #include <cglib/imgui/imgui_impl_glfw_gl2.h>
 #include <cglib/imgui/imgui_impl_glfw_gl3.h>
 
+#include <glm/gtc/packing.hpp>
+
 #include <iostream>
 #include <algorithm>
 #include <functional>
 #include <cstdlib>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 
 using std::cout;
 using std::cerr;
@@ -20,6 +26,21 @@ using std::flush;
 static GLFWwindow *window;
 static unsigned int tex_frame_buffer;
 static unsigned int program_draw_texture;
+
+// The frame buffer is uploaded through a ring of pixel buffer objects, so
+// that filling one does not wait for the transfer from the previous one.
+static int const num_upload_buffers = 3;
+static unsigned int upload_buffers[num_upload_buffers];
+static int next_upload_buffer = 0;
+// Used if mapping a pixel buffer object fails.
+static std::vector<char> upload_staging;
+// The Parameters::DisplayUpload format tex_frame_buffer was created with,
+// -1 before the first upload.
+static int texture_upload_format = -1;
+// The tone mapping applied to 8 bit uploads.
+static float uploaded_exposure   = 0.f;
+static float uploaded_gamma      = 0.f;
+static bool  uploaded_desaturate = false;
 static double cursor_x, cursor_y;
 static bool in_camera_drag = false;
 
@@ -419,22 +440,185 @@ init_host_texture(Parameters const& params)
 "varying vec2 tex_coord;\n"
 "uniform float gamma;\n"
 "uniform float exposure;\n"
+"uniform float desaturate;\n"
 "uniform sampler2D framebuffer;\n"
 "void\n"
 "main()\n"
 "{\n"
-"	gl_FragColor = pow(2, exposure) * pow(texture2D(framebuffer, tex_coord), vec4(gamma));\n"
+"	vec4 color = texture2D(framebuffer, tex_coord);\n"
+"	color.rgb = mix(color.rgb, vec3(dot(vec3(0.299, 0.587, 0.114), color.rgb)), desaturate);\n"
+"	gl_FragColor = pow(2, exposure) * pow(color, vec4(gamma));\n"
 "}\n" }
 );
 	glGenTextures(1, &tex_frame_buffer);
 	glBindTexture(GL_TEXTURE_2D, tex_frame_buffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, params.image_width, params.image_height, 0,
-		GL_RGBA, GL_FLOAT, nullptr);
-	glGenerateMipmap(GL_TEXTURE_2D);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	// The storage is created on the first upload, in the upload format.
+	texture_upload_format = -1;
+
+	glGenBuffers(num_upload_buffers, upload_buffers);
+}
+
+// -----------------------------------------------------------------------------
+
+static std::size_t
+upload_texel_size(int format)
+{
+	switch (format)
+	{
+		case Parameters::DISPLAY_UPLOAD_FLOAT16: return 4 * sizeof(std::uint16_t);
+		case Parameters::DISPLAY_UPLOAD_UNORM8:  return 4 * sizeof(std::uint8_t);
+		default:                                 return 4 * sizeof(float);
+	}
+}
+
+// Converts one rectangle of the frame buffer to the upload format, row by
+// row without padding.
+static void
+convert_rect(Image const& frame_buffer, glm::ivec4 const& rect, int format, char* dst)
+{
+	glm::vec4 const* pixels = frame_buffer.getPixels();
+	int const stride = frame_buffer.getWidth();
+	int const width  = rect.z - rect.x;
+	float const scale     = std::pow(2.f, parameters->exposure);
+	float const inv_gamma = 1.f / parameters->gamma;
+
+	for (int y = rect.y; y < rect.w; ++y)
+	{
+		glm::vec4 const* src = pixels + y * stride + rect.x;
+		switch (format)
+		{
+			case Parameters::DISPLAY_UPLOAD_FLOAT16:
+			{
+				std::uint64_t* row = reinterpret_cast<std::uint64_t*>(dst);
+				for (int x = 0; x < width; ++x)
+				{
+					row[x] = glm::packHalf4x16(src[x]);
+				}
+				break;
+			}
+			case Parameters::DISPLAY_UPLOAD_UNORM8:
+			{
+				// Same tone mapping as the display shader.
+				std::uint8_t* row = reinterpret_cast<std::uint8_t*>(dst);
+				for (int x = 0; x < width; ++x)
+				{
+					glm::vec4 c = src[x];
+					if (parameters->desaturate)
+					{
+						c = glm::vec4(glm::vec3(glm::dot(glm::vec3(0.299f, 0.587f, 0.114f), glm::vec3(c))), c.a);
+					}
+					c = scale * glm::pow(glm::max(c, glm::vec4(0.f)), glm::vec4(inv_gamma));
+					glm::vec4 const u = glm::clamp(c, 0.f, 1.f) * 255.f + 0.5f;
+					row[4 * x + 0] = std::uint8_t(u.r);
+					row[4 * x + 1] = std::uint8_t(u.g);
+					row[4 * x + 2] = std::uint8_t(u.b);
+					row[4 * x + 3] = std::uint8_t(u.a);
+				}
+				break;
+			}
+			default:
+				std::memcpy(dst, src, width * sizeof(glm::vec4));
+				break;
+		}
+		dst += width * upload_texel_size(format);
+	}
+}
+
+bool GUI::
+needs_full_upload()
+{
+	int const format = parameters->display_upload;
+	if (format != texture_upload_format)
+	{
+		return true;
+	}
+	// The tone mapping of 8 bit uploads is part of the texture.
+	return format == Parameters::DISPLAY_UPLOAD_UNORM8
+		&& (uploaded_exposure   != parameters->exposure
+		 || uploaded_gamma      != parameters->gamma
+		 || uploaded_desaturate != parameters->desaturate);
+}
+
+// Uploads the given rectangles of the frame buffer, or all of it if dirty
+// is null, and updates the mipmaps.
+static void
+upload_frame_buffer(Image const& frame_buffer, std::vector<glm::ivec4> const* dirty)
+{
+	int const format = parameters->display_upload;
+	int const width  = frame_buffer.getWidth();
+	int const height = frame_buffer.getHeight();
+
+	if (format != texture_upload_format)
+	{
+		// Start out black. Pixels that are still being rendered are not
+		// uploaded until they are dirty.
+		GLint const internal_format = format == Parameters::DISPLAY_UPLOAD_FLOAT16 ? GL_RGBA16F
+			: format == Parameters::DISPLAY_UPLOAD_UNORM8 ? GL_RGBA8 : GL_RGBA32F;
+		std::vector<std::uint8_t> const black(std::size_t(width) * std::size_t(height) * 4, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, black.data());
+		texture_upload_format = format;
+	}
+	if (format == Parameters::DISPLAY_UPLOAD_UNORM8)
+	{
+		uploaded_exposure   = parameters->exposure;
+		uploaded_gamma      = parameters->gamma;
+		uploaded_desaturate = parameters->desaturate;
+	}
+
+	std::vector<glm::ivec4> const all = { glm::ivec4(0, 0, width, height) };
+	std::vector<glm::ivec4> const& rects = dirty ? *dirty : all;
+	if (rects.empty())
+	{
+		return;
+	}
+
+	std::size_t const texel_size = upload_texel_size(format);
+	std::size_t size = 0;
+	for (auto const& r : rects)
+	{
+		size += std::size_t(r.z - r.x) * std::size_t(r.w - r.y) * texel_size;
+	}
+
+	// Orphan the buffer, so the driver need not wait until an earlier
+	// transfer from it has finished.
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[next_upload_buffer]);
+	next_upload_buffer = (next_upload_buffer + 1) % num_upload_buffers;
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	char* mapped = static_cast<char*>(glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+	if (!mapped)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		upload_staging.resize(size);
+	}
+	char* const base = mapped ? mapped : upload_staging.data();
+
+	std::size_t offset = 0;
+	for (auto const& r : rects)
+	{
+		convert_rect(frame_buffer, r, format, base + offset);
+		offset += std::size_t(r.z - r.x) * std::size_t(r.w - r.y) * texel_size;
+	}
+	if (mapped)
+	{
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	GLenum const type = format == Parameters::DISPLAY_UPLOAD_FLOAT16 ? GL_HALF_FLOAT
+		: format == Parameters::DISPLAY_UPLOAD_UNORM8 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+	offset = 0;
+	for (auto const& r : rects)
+	{
+		// With a bound pixel buffer object, the data pointer is an offset.
+		void const* data = mapped ? reinterpret_cast<void const*>(offset) : upload_staging.data() + offset;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.z - r.x, r.w - r.y, GL_RGBA, type, data);
+		offset += std::size_t(r.z - r.x) * std::size_t(r.w - r.y) * texel_size;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glGenerateMipmap(GL_TEXTURE_2D);
 }
 
 // -----------------------------------------------------------------------------
@@ -484,12 +668,22 @@ init_host(Parameters& params)
 }
 
 int GUI::
-display_host(Image const& frame_buffer, std::function<void()> const& render_overlay)
+display_host(Image const& frame_buffer, std::function<void()> const& render_overlay,
+	std::vector<glm::ivec4> const* dirty)
 {
 	if (write_screenshot)
 	{
 		write_screenshot = false;
-		frame_buffer.save("screenshot.png", 2.2f);
+		if (parameters->desaturate)
+		{
+			Image screenshot = frame_buffer;
+			screenshot.desaturate();
+			screenshot.save("screenshot.png", 2.2f);
+		}
+		else
+		{
+			frame_buffer.save("screenshot.png", 2.2f);
+		}
 	}
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -505,13 +699,15 @@ display_host(Image const& frame_buffer, std::function<void()> const& render_over
 	glUseProgram(program_draw_texture);
 	glUniform1f(glGetUniformLocation(program_draw_texture, "w"), w);
 	glUniform1f(glGetUniformLocation(program_draw_texture, "h"), h);
-	glUniform1f(glGetUniformLocation(program_draw_texture, "gamma"), 1.0f / parameters->gamma);
-	glUniform1f(glGetUniformLocation(program_draw_texture, "exposure"), parameters->exposure);
+	// 8 bit uploads are tone mapped already.
+	bool const tone_mapped = parameters->display_upload == Parameters::DISPLAY_UPLOAD_UNORM8;
+	glUniform1f(glGetUniformLocation(program_draw_texture, "gamma"), tone_mapped ? 1.0f : 1.0f / parameters->gamma);
+	glUniform1f(glGetUniformLocation(program_draw_texture, "exposure"), tone_mapped ? 0.0f : parameters->exposure);
+	glUniform1f(glGetUniformLocation(program_draw_texture, "desaturate"), 
+		!tone_mapped && parameters->desaturate ? 1.0f : 0.0f);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, tex_frame_buffer);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, /* x offset */ 0, /* y offset */ 0,
-		frame_buffer.getWidth(), frame_buffer.getHeight(), GL_RGBA, GL_FLOAT, frame_buffer.raw_data());
-	glGenerateMipmap(GL_TEXTURE_2D);
+	upload_frame_buffer(frame_buffer, dirty);
 	glRectf(-1.0f, -1.0f, 1.0f, 1.0f);
 
 	glUseProgram(0);
@@ -522,12 +718,18 @@ display_host(Image const& frame_buffer, std::function<void()> const& render_over
 	ImGui::Begin("Settings");
 
 	int update_flags = parameters->display_parameters();
+	if (ImGui::CollapsingHeader("Profiler"))
+	{
+		Profiler::display();
+	}
 	if (ImGui::CollapsingHeader("Gui Settings"))
 	{
 		if (ImGui::DragFloat("Scale Font", &ImGui::GetIO().FontGlobalScale, 0.005, 0.3f, 2.5f, "%.1f"))
 		{
 			ImGui::ForceIniSettingsDirty();
 		}
+		ImGui::Combo("Display Upload", &parameters->display_upload, 
+			parameters->display_upload_names, Parameters::DISPLAY_UPLOAD_COUNT);
 	}
 
 	ImGui::End();
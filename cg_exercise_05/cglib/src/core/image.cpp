@@ -2,6 +2,8 @@
 #include <cglib/core/stb_image.h>
 #include <cglib/core/stb_image_write.h>
 #include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/stereo.h>
 
 #include <cstdlib>
 #include <cstdint>
@@ -215,21 +217,42 @@ void Image::load_pfm(std::string const& path)
 
 void Image::tonemap_01(float exposure, float gamma)
 {
-	glm::vec4 maxval {0.f, 0.f, 0.f, 0.f};
-	for (int y = 0; y < m_height; ++y)
-	{
-		for (int x = 0; x < m_width; ++x)
+	glm::vec4 const maxval = parallel_reduce(0, m_height, glm::vec4 {0.f, 0.f, 0.f, 0.f},
+		[&](int y)
 		{
-			maxval = max(getPixel(x, y), maxval);
-		}
-	}
-	for (int y = 0; y < m_height; ++y)
-	{
-		for (int x = 0; x < m_width; ++x)
+			glm::vec4 row_max {0.f, 0.f, 0.f, 0.f};
+			for (int x = 0; x < m_width; ++x)
+			{
+				row_max = max(getPixel(x, y), row_max);
+			}
+			return row_max;
+		},
+		[](glm::vec4 const& a, glm::vec4 const& b) { return max(a, b); });
+
+	parallel_for(0, m_height, [&](int y)
 		{
-			setPixel(x, y, pow(std::pow(2.f, exposure) * getPixel(x, y) / maxval, glm::vec4{1.f/gamma}));
-		}
-	}
+			for (int x = 0; x < m_width; ++x)
+			{
+				setPixel(x, y, pow(std::pow(2.f, exposure) * getPixel(x, y) / maxval, glm::vec4{1.f/gamma}));
+			}
+		});
+}
+
+void Image::desaturate()
+{
+	desaturate(ThreadPool::get_active());
+}
+
+void Image::desaturate(ThreadPool& pool)
+{
+	parallel_for(pool, 0, m_height, [&](int y)
+		{
+			for (int x = 0; x < m_width; ++x)
+			{
+				glm::vec4 const& p = getPixel(x, y);
+				setPixel(x, y, glm::vec4(::desaturate(glm::vec3(p)), p.a));
+			}
+		});
 }
 
 /*
@@ -331,33 +354,36 @@ void DiscreteFourier2D::reconstruct(
 {
 	// separated transform
 	std::vector<std::complex<float>> tmp(M*N, std::complex<float>(0.0f, 0.0f));
-	for (int l = 0; l < N; ++l) // row
-	for (int k = 0; k < M; ++k) // column
+	parallel_for(0, N, [&](int l) // row
 	{
-		// transformation over column
-		std::complex<float> x_kl = 0;
-		for (int n = 0; n < N; ++n) 
+		for (int k = 0; k < M; ++k) // column
 		{
-			std::complex<float> exponent { 0, 
-				2.f * float(M_PI) * l * (float(n)/N - 0.5f) };
-			x_kl += spectrum[k+n*M] * std::exp(exponent);
-			
+			// transformation over column
+			std::complex<float> x_kl = 0;
+			for (int n = 0; n < N; ++n) 
+			{
+				std::complex<float> exponent { 0, 
+					2.f * float(M_PI) * l * (float(n)/N - 0.5f) };
+				x_kl += spectrum[k+n*M] * std::exp(exponent);
+				
+			}
+			tmp[k+l*M] = x_kl;
 		}
-		tmp[k+l*M] = x_kl;
-	}
-	for (int l = 0; l < N; ++l) // row
-	for (int k = 0; k < M; ++k) // column
+	});
+	parallel_for(0, N, [&](int l) // row
 	{
-		// transformation over row
-		std::complex<float> x_kl = 0;
-		for (int m = 0; m < M; ++m)
+		for (int k = 0; k < M; ++k) // column
 		{
-			std::complex<float> exponent { 0, 
-				2.f * float(M_PI) * k * (float(m)/M - 0.5f) };
-			x_kl += tmp[m+l*M] * std::exp(exponent);
-			
+			// transformation over row
+			std::complex<float> x_kl = 0;
+			for (int m = 0; m < M; ++m)
+			{
+				std::complex<float> exponent { 0, 
+					2.f * float(M_PI) * k * (float(m)/M - 0.5f) };
+				x_kl += tmp[m+l*M] * std::exp(exponent);
+				
+			}
+			reconstruction[k+l*M] = 1.f/std::sqrt(float(M*N)) * x_kl;
 		}
-		reconstruction[k+l*M] = 1.f/std::sqrt(float(M*N)) * x_kl;
-	}
+	});
 }
-
@@ -1,4 +1,5 @@
 #include <cglib/core/parameters.h>
+#include <cglib/core/thread_pool.h>
 
 #include <iostream>
 #include <sstream>
@@ -40,8 +41,27 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 				<< "--width  N           The output image width.\n"
 				<< "--height N           The output image height.\n"
 				<< "--num-threads N      The number of threads to be used for rendering. Minimum 1.\n"
-				<< "--tile-size N        The size of one work unit, in pixels.\n"
+				<< "--thread-affinity P  Pin worker threads: none, compact, scatter or a cpu list (0,2,4-7).\n"
+				<< "--tile-size N        The size of one work unit, in pixels, or 'auto'.\n"
+				<< "--tile-order O       Tile order: spiral, hilbert or morton.\n"
 				<< "--fps N              The display rate.\n"
+				<< "--display-upload F   Frame buffer upload format: float32, float16 or unorm8.\n"
+				<< "--spp N              Samples per pixel.\n"
+				<< "--bvh-builder B      BVH construction: median, sah, lbvh or trbvh.\n"
+				<< "--bvh-traversal T    BVH traversal: recursive (default), compact or wide.\n"
+				<< "--benchmark SCENE    Render SCENE headless and report timings as JSON.\n"
+				<< "--warmup N           Untimed benchmark frames (default 1).\n"
+				<< "--repeat N           Timed benchmark frames (default 5).\n"
+				<< "--camera-path FILE   Benchmark and sequence camera poses, 'px py pz dx dy dz' per line.\n"
+				<< "--sequence PATTERN   Render one image per camera path pose to PATTERN, '#' for digits.\n"
+				<< "--sequence-queue N   Frames that may wait to be written (default 4).\n"
+				<< "--io-threads N       Threads writing sequence frames (default 2).\n"
+				<< "--benchmark-output F Write the benchmark report to F instead of stdout.\n"
+				<< "--trace FILE         Write a Chrome trace of all rendered tiles to FILE.\n"
+				<< "--render-workers N   Render noninteractive images with N local worker processes.\n"
+				<< "--remote-workers N   Also wait for N workers to connect to the --listen address.\n"
+				<< "--listen ADDRESS     Coordinator address, unix:PATH or HOST:PORT.\n"
+				<< "--worker ADDRESS     Render tiles for the coordinator at ADDRESS.\n"
 				<< "--help, -h           Display this information.\n"
 				<< std::flush;
 			return false;
@@ -106,10 +126,37 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 				std::cout << "num_threads: " << num_threads << std::endl;
 			}
 
+			else if (arg == "--thread-affinity")
+			{
+				success = bool(is >> thread_affinity) && ThreadAffinity().parse(thread_affinity);
+			}
+
 			else if (arg == "--tile-size")
 			{
-				success = bool(is >> tile_size);
-				tile_size = std::max<std::uint32_t>(1, tile_size);
+				if (is.str() == "auto")
+				{
+					tile_size = 0;
+				}
+				else
+				{
+					success = bool(is >> tile_size);
+					tile_size = std::max<std::uint32_t>(1, tile_size);
+				}
+			}
+
+			else if (arg == "--tile-order")
+			{
+				std::string order;
+				success = bool(is >> order);
+				tile_order = TILE_ORDER_COUNT;
+				for (int o = 0; o < TILE_ORDER_COUNT; ++o)
+				{
+					if (order == tile_order_names[o])
+					{
+						tile_order = o;
+					}
+				}
+				success = success && tile_order != TILE_ORDER_COUNT;
 			}
 
 			else if (arg == "--fps")
@@ -118,10 +165,100 @@ bool Parameters::parse_command_line(int argc, char const** argv)
 				fps = std::max<std::uint32_t>(1, fps);
 			}
 
+			else if (arg == "--display-upload")
+			{
+				std::string format;
+				success = bool(is >> format);
+				display_upload = DISPLAY_UPLOAD_COUNT;
+				for (int f = 0; f < DISPLAY_UPLOAD_COUNT; ++f)
+				{
+					if (format == display_upload_names[f])
+					{
+						display_upload = f;
+					}
+				}
+				success = success && display_upload != DISPLAY_UPLOAD_COUNT;
+			}
+
 			else if (arg == "--eye-separation")
 			{
 				success = bool(is >> eye_separation);
 			}
+
+			else if (arg == "--benchmark")
+			{
+				success = bool(is >> benchmark_scene);
+				interactive = false;
+			}
+
+			else if (arg == "--warmup")
+			{
+				success = bool(is >> benchmark_warmup) && benchmark_warmup >= 0;
+			}
+
+			else if (arg == "--repeat")
+			{
+				success = bool(is >> benchmark_repeat) && benchmark_repeat >= 1;
+			}
+
+			else if (arg == "--camera-path")
+			{
+				success = bool(is >> benchmark_camera_path);
+			}
+
+			else if (arg == "--benchmark-output")
+			{
+				success = bool(is >> benchmark_output);
+			}
+
+			else if (arg == "--sequence")
+			{
+				success = bool(is >> sequence_output);
+				interactive = false;
+			}
+
+			else if (arg == "--sequence-queue")
+			{
+				success = bool(is >> sequence_queue) && sequence_queue >= 1;
+			}
+
+			else if (arg == "--io-threads")
+			{
+				success = bool(is >> sequence_io_threads) && sequence_io_threads >= 1;
+			}
+
+			else if (arg == "--trace")
+			{
+				success = bool(is >> trace_file);
+			}
+
+			else if (arg == "--render-workers")
+			{
+				success = bool(is >> distribution.local_workers) && distribution.local_workers >= 0;
+				interactive = false;
+			}
+
+			else if (arg == "--remote-workers")
+			{
+				success = bool(is >> distribution.remote_workers) && distribution.remote_workers >= 0;
+				interactive = false;
+			}
+
+			else if (arg == "--listen")
+			{
+				success = bool(is >> distribution.listen_address);
+			}
+
+			else if (arg == "--worker")
+			{
+				success = bool(is >> distribution.worker_address);
+				interactive = false;
+			}
+
+			else
+			{
+				derived_parse_option(arg, is, &success);
+			}
 			
 			if (!success)
 			{
@@ -140,6 +277,7 @@ bool Parameters::change_requires_restart(Parameters const& old) const
 {
 	const bool restart = false
 		|| tile_size != old.tile_size
+		|| tile_order != old.tile_order
 		|| derived_change_requires_restart(old)
 		;
 	return restart;
@@ -0,0 +1,225 @@
+#include <cglib/core/profiler.h>
+#include <cglib/imgui/imgui.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+char const* const Profiler::counter_names[COUNTER_COUNT] = {
+	"Primary Rays", "Shadow Rays", "Secondary Rays",
+	"BVH Node Visits", "Triangle Tests", "Texture Fetches"
+};
+
+char const* const Profiler::scope_names[SCOPE_COUNT] = {
+	"tile", "shoot_ray", "visible", "shade"
+};
+
+std::atomic<bool> Profiler::tracing { false };
+
+// All threads that ever used the profiler. Never shrinks, so the totals
+// include threads that have exited.
+static std::mutex                                        registry_mutex;
+static std::vector<std::unique_ptr<Profiler::ThreadData>> registry;
+static std::atomic<std::uint64_t>                         reset_ticks { Profiler::ticks() };
+
+// -----------------------------------------------------------------------------
+
+double Profiler::ticks_per_us()
+{
+	static double const calibrated = []()
+		{
+			auto const start_time = std::chrono::steady_clock::now();
+			std::uint64_t const start_ticks = ticks();
+			while (std::chrono::steady_clock::now() - start_time < std::chrono::milliseconds(10))
+			{
+			}
+			auto const end_time = std::chrono::steady_clock::now();
+			std::uint64_t const end_ticks = ticks();
+			double const us = std::chrono::duration<double, std::micro>(end_time - start_time).count();
+			return std::max(1e-3, double(end_ticks - start_ticks) / us);
+		}();
+	return calibrated;
+}
+
+Profiler::ThreadData* Profiler::register_thread()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	registry.emplace_back(new ThreadData());
+	ThreadData* data = registry.back().get();
+	data->name = "thread " + std::to_string(registry.size() - 1);
+	return data;
+}
+
+void Profiler::set_thread_name(std::string const& name)
+{
+	ThreadData& data = local();
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	data.name = name;
+}
+
+// -----------------------------------------------------------------------------
+
+void Profiler::set_tracing(bool enable)
+{
+	tracing.store(enable);
+}
+
+void Profiler::clear_trace()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	for (auto& data : registry)
+	{
+		data->events.clear();
+	}
+}
+
+bool Profiler::write_chrome_trace(std::string const& file_name)
+{
+	std::ofstream file(file_name);
+	if (!file)
+	{
+		return false;
+	}
+
+	// Timestamps are microseconds since the first event.
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	std::uint64_t first = ~std::uint64_t(0);
+	for (auto const& data : registry)
+	{
+		for (auto const& e : data->events)
+		{
+			first = std::min(first, e.begin);
+		}
+	}
+	double const tpus = ticks_per_us();
+
+	file << "{\"traceEvents\":[\n";
+	bool separator = false;
+	for (std::size_t tid = 0; tid < registry.size(); ++tid)
+	{
+		ThreadData const& data = *registry[tid];
+		if (data.events.empty())
+		{
+			continue;
+		}
+
+		file << (separator ? ",\n" : "")
+			<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << tid
+			<< ",\"args\":{\"name\":\"" << data.name << "\"}}";
+		separator = true;
+
+		for (auto const& e : data.events)
+		{
+			file << ",\n{\"name\":\"" << scope_names[e.scope] << " " << e.id << "\""
+				<< ",\"cat\":\"" << scope_names[e.scope] << "\""
+				<< ",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+				<< ",\"ts\":" << double(e.begin - first) / tpus
+				<< ",\"dur\":" << double(e.end - e.begin) / tpus
+				<< ",\"args\":{\"id\":" << e.id << "}}";
+		}
+	}
+	file << "\n]}\n";
+
+	return bool(file);
+}
+
+// -----------------------------------------------------------------------------
+
+void Profiler::reset()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	for (auto& data : registry)
+	{
+		for (auto& c : data->counters)    c.store(0, std::memory_order_relaxed);
+		for (auto& t : data->scope_ticks) t.store(0, std::memory_order_relaxed);
+		for (auto& c : data->scope_calls) c.store(0, std::memory_order_relaxed);
+	}
+	reset_ticks.store(ticks());
+}
+
+Profiler::Totals Profiler::totals()
+{
+	Totals totals;
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	for (auto const& data : registry)
+	{
+		for (int i = 0; i < COUNTER_COUNT; ++i)
+		{
+			totals.counters[i] += data->counters[i].load(std::memory_order_relaxed);
+		}
+		for (int i = 0; i < SCOPE_COUNT; ++i)
+		{
+			totals.scope_ticks[i] += data->scope_ticks[i].load(std::memory_order_relaxed);
+			totals.scope_calls[i] += data->scope_calls[i].load(std::memory_order_relaxed);
+		}
+	}
+	totals.elapsed_ticks = ticks() - reset_ticks.load();
+	return totals;
+}
+
+// -----------------------------------------------------------------------------
+
+void Profiler::display()
+{
+	Totals const t = totals();
+	double const elapsed_ms = std::max(1e-3, ticks_to_ms(t.elapsed_ticks));
+
+	ImGui::Text("Since last restart: %.1f ms", elapsed_ms);
+	ImGui::Separator();
+
+#ifdef CG_PROFILING
+	ImGui::Columns(3, "profiler_counters");
+	ImGui::Text("Counter"); ImGui::NextColumn();
+	ImGui::Text("Total");   ImGui::NextColumn();
+	ImGui::Text("M/s");     ImGui::NextColumn();
+	for (int i = 0; i < COUNTER_COUNT; ++i)
+	{
+		ImGui::Text("%s", counter_names[i]); ImGui::NextColumn();
+		ImGui::Text("%llu", static_cast<unsigned long long>(t.counters[i])); ImGui::NextColumn();
+		ImGui::Text("%.2f", double(t.counters[i]) / (elapsed_ms * 1000.0)); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+	ImGui::Separator();
+
+	// Scopes nest, so their times are inclusive and summed over threads.
+	ImGui::Columns(3, "profiler_scopes");
+	ImGui::Text("Scope");   ImGui::NextColumn();
+	ImGui::Text("ms");      ImGui::NextColumn();
+	ImGui::Text("ns/call"); ImGui::NextColumn();
+	for (int i = 0; i < SCOPE_COUNT; ++i)
+	{
+		double const ms = ticks_to_ms(t.scope_ticks[i]);
+		ImGui::Text("%s", scope_names[i]); ImGui::NextColumn();
+		ImGui::Text("%.1f", ms); ImGui::NextColumn();
+		ImGui::Text("%.0f", t.scope_calls[i] ? ms * 1e6 / double(t.scope_calls[i]) : 0.0); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+#else
+	ImGui::Text("Counters and ray scopes need cmake -DCG_PROFILING=ON.");
+#endif
+	ImGui::Separator();
+
+	// Time spent in tiles per thread, relative to the busiest thread.
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	std::uint64_t max_ticks = 1;
+	for (auto const& data : registry)
+	{
+		max_ticks = std::max(max_ticks, data->scope_ticks[SCOPE_TILE].load(std::memory_order_relaxed));
+	}
+	for (auto const& data : registry)
+	{
+		std::uint64_t const tile_ticks = data->scope_ticks[SCOPE_TILE].load(std::memory_order_relaxed);
+		std::uint64_t const tiles      = data->scope_calls[SCOPE_TILE].load(std::memory_order_relaxed);
+		if (tiles == 0)
+		{
+			continue;
+		}
+		std::ostringstream label;
+		label << data->name << ": " << tiles << " tiles, "
+			<< static_cast<int>(ticks_to_ms(tile_ticks)) << " ms";
+		ImGui::ProgressBar(float(double(tile_ticks) / double(max_ticks)), ImVec2(-1, 0), label.str().c_str());
+	}
+}
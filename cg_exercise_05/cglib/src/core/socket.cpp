@@ -0,0 +1,340 @@
+#include <cglib/core/socket.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define CG_HAVE_SOCKETS 1
+#  include <cerrno>
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <sys/types.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+// Larger messages are considered a broken connection.
+static std::uint32_t const max_message_size = 1u << 30;
+
+#ifdef CG_HAVE_SOCKETS
+
+static std::string const unix_prefix = "unix:";
+
+static bool is_unix_address(std::string const& address)
+{
+	return address.compare(0, unix_prefix.size(), unix_prefix) == 0;
+}
+
+static bool unix_socket_address(std::string const& path, sockaddr_un* addr)
+{
+	std::memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr->sun_path))
+	{
+		std::cerr << "[Socket] " << "Invalid unix socket path '" << path << "'" << std::endl;
+		return false;
+	}
+	std::memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+// Resolves "host:port". Free the result with freeaddrinfo().
+static addrinfo* tcp_socket_address(std::string const& address, bool passive)
+{
+	std::size_t const colon = address.rfind(':');
+	if (colon == std::string::npos)
+	{
+		std::cerr << "[Socket] " << "Address '" << address << "' is neither unix:PATH nor HOST:PORT" << std::endl;
+		return nullptr;
+	}
+	std::string const host = address.substr(0, colon);
+	std::string const port = address.substr(colon + 1);
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = passive ? AI_PASSIVE : 0;
+
+	addrinfo* result = nullptr;
+	int const error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+	if (error != 0)
+	{
+		std::cerr << "[Socket] " << "Cannot resolve '" << address << "': " << gai_strerror(error) << std::endl;
+		return nullptr;
+	}
+	return result;
+}
+
+// Tiles are sent as soon as they are complete.
+static void disable_nagle(int fd)
+{
+	int const one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static bool write_all(int fd, char const* data, std::size_t size)
+{
+#ifdef MSG_NOSIGNAL
+	int const flags = MSG_NOSIGNAL;
+#else
+	int const flags = 0;
+#endif
+	while (size > 0)
+	{
+		ssize_t const n = ::send(fd, data, size, flags);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		data += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+static bool read_all(int fd, char* data, std::size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t const n = ::recv(fd, data, size, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		data += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+
+MessageSocket& MessageSocket::operator=(MessageSocket&& other)
+{
+	if (this != &other)
+	{
+		close();
+		m_fd = other.m_fd;
+		other.m_fd = -1;
+	}
+	return *this;
+}
+
+void MessageSocket::close()
+{
+#ifdef CG_HAVE_SOCKETS
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+	}
+#endif
+	m_fd = -1;
+}
+
+MessageSocket MessageSocket::connect(std::string const& address, int timeout_seconds)
+{
+#ifdef CG_HAVE_SOCKETS
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+	for (;;)
+	{
+		if (is_unix_address(address))
+		{
+			sockaddr_un addr;
+			if (!unix_socket_address(address.substr(unix_prefix.size()), &addr))
+			{
+				return MessageSocket();
+			}
+			MessageSocket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+			if (socket.is_open() && ::connect(socket.fd(), reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) == 0)
+			{
+				return socket;
+			}
+		}
+		else
+		{
+			addrinfo* const info = tcp_socket_address(address, false);
+			if (!info)
+			{
+				return MessageSocket();
+			}
+			for (addrinfo const* ai = info; ai; ai = ai->ai_next)
+			{
+				MessageSocket socket(::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+				if (socket.is_open() && ::connect(socket.fd(), ai->ai_addr, ai->ai_addrlen) == 0)
+				{
+					freeaddrinfo(info);
+					disable_nagle(socket.fd());
+					return socket;
+				}
+			}
+			freeaddrinfo(info);
+		}
+
+		// The other side may not be listening yet.
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			std::cerr << "[Socket] " << "Cannot connect to '" << address << "'" << std::endl;
+			return MessageSocket();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+#else
+	std::cerr << "[Socket] " << "Sockets are not supported on this platform, cannot connect to '"
+		<< address << "'" << std::endl;
+	(void) timeout_seconds;
+	return MessageSocket();
+#endif
+}
+
+bool MessageSocket::send(std::vector<char> const& message)
+{
+#ifdef CG_HAVE_SOCKETS
+	if (!is_open() || message.size() > max_message_size)
+	{
+		return false;
+	}
+	std::uint32_t const size = static_cast<std::uint32_t>(message.size());
+	return write_all(m_fd, reinterpret_cast<char const*>(&size), sizeof(size))
+		&& write_all(m_fd, message.data(), message.size());
+#else
+	(void) message;
+	return false;
+#endif
+}
+
+bool MessageSocket::receive(std::vector<char>* message)
+{
+#ifdef CG_HAVE_SOCKETS
+	std::uint32_t size = 0;
+	if (!is_open() || !read_all(m_fd, reinterpret_cast<char*>(&size), sizeof(size)) || size > max_message_size)
+	{
+		return false;
+	}
+	message->resize(size);
+	return read_all(m_fd, message->data(), size);
+#else
+	(void) message;
+	return false;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+
+bool ListenSocket::listen(std::string const& address)
+{
+	close();
+#ifdef CG_HAVE_SOCKETS
+	if (is_unix_address(address))
+	{
+		std::string const path = address.substr(unix_prefix.size());
+		sockaddr_un addr;
+		if (!unix_socket_address(path, &addr))
+		{
+			return false;
+		}
+		// A stale socket file of an earlier run blocks bind().
+		::unlink(path.c_str());
+		m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m_fd < 0
+			|| ::bind(m_fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0
+			|| ::listen(m_fd, SOMAXCONN) != 0)
+		{
+			std::cerr << "[Socket] " << "Cannot listen on '" << address << "'" << std::endl;
+			close();
+			return false;
+		}
+		m_unixPath = path;
+		return true;
+	}
+
+	addrinfo* const info = tcp_socket_address(address, true);
+	if (!info)
+	{
+		return false;
+	}
+	for (addrinfo const* ai = info; ai && m_fd < 0; ai = ai->ai_next)
+	{
+		m_fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		int const one = 1;
+		if (m_fd >= 0)
+		{
+			setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		}
+		if (m_fd >= 0 && (::bind(m_fd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(m_fd, SOMAXCONN) != 0))
+		{
+			close();
+		}
+	}
+	freeaddrinfo(info);
+	if (m_fd < 0)
+	{
+		std::cerr << "[Socket] " << "Cannot listen on '" << address << "'" << std::endl;
+		return false;
+	}
+	return true;
+#else
+	std::cerr << "[Socket] " << "Sockets are not supported on this platform, cannot listen on '"
+		<< address << "'" << std::endl;
+	return false;
+#endif
+}
+
+void ListenSocket::close()
+{
+#ifdef CG_HAVE_SOCKETS
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+	}
+	if (!m_unixPath.empty())
+	{
+		::unlink(m_unixPath.c_str());
+	}
+#endif
+	m_fd = -1;
+	m_unixPath.clear();
+}
+
+MessageSocket ListenSocket::accept(int timeout_ms)
+{
+#ifdef CG_HAVE_SOCKETS
+	if (!is_open())
+	{
+		return MessageSocket();
+	}
+	pollfd pfd = { m_fd, POLLIN, 0 };
+	int ready = 0;
+	do
+	{
+		ready = ::poll(&pfd, 1, timeout_ms);
+	} while (ready < 0 && errno == EINTR);
+	if (ready <= 0)
+	{
+		return MessageSocket();
+	}
+	MessageSocket socket(::accept(m_fd, nullptr, nullptr));
+	if (socket.is_open() && m_unixPath.empty())
+	{
+		disable_nagle(socket.fd());
+	}
+	return socket;
+#else
+	(void) timeout_ms;
+	return MessageSocket();
+#endif
+}
@@ -1,12 +1,286 @@
 #include <cglib/core/thread_pool.h>
 #include <cglib/core/timer.h>
+#include <cglib/core/profiler.h>
 
 #include <cglib/core/assert.h>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
-ThreadPool::ThreadPool(unsigned max_threads) :
-	m_numJobs(0), m_hasException(false)
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// -----------------------------------------------------------------------------
+
+// Parse a cpu list in the format of /sys/devices/system/node/node*/cpulist,
+// e.g. "0-3,8,10-11".
+static bool parse_cpu_list(std::string const& str, std::vector<int>* cpus)
+{
+	std::istringstream is(str);
+	std::string range;
+	while (std::getline(is, range, ','))
+	{
+		std::istringstream rs(range);
+		int first = 0, last = 0;
+		if (!(rs >> first) || first < 0)
+		{
+			return false;
+		}
+		last = first;
+		if (rs.peek() == '-')
+		{
+			rs.get();
+			if (!(rs >> last) || last < first)
+			{
+				return false;
+			}
+		}
+		for (int cpu = first; cpu <= last; ++cpu)
+		{
+			cpus->push_back(cpu);
+		}
+	}
+	return !cpus->empty();
+}
+
+// The cpus this process may run on, grouped by NUMA node.
+static std::vector<std::vector<int>> numa_nodes()
+{
+	std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		return nodes;
+	}
+
+	for (int node = 0; node < 1024; ++node)
+	{
+		std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string list;
+		std::vector<int> cpus, node_cpus;
+		if (!file || !std::getline(file, list) || !parse_cpu_list(list, &cpus))
+		{
+			continue;
+		}
+		for (int cpu : cpus)
+		{
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+			{
+				node_cpus.push_back(cpu);
+			}
+		}
+		if (!node_cpus.empty())
+		{
+			nodes.push_back(node_cpus);
+		}
+	}
+
+	// No NUMA information, treat the machine as a single node.
+	if (nodes.empty())
+	{
+		nodes.emplace_back();
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+			{
+				nodes.back().push_back(cpu);
+			}
+		}
+	}
+#endif
+	return nodes;
+}
+
+bool ThreadAffinity::parse(std::string const& str)
+{
+	cpus.clear();
+	if (str == "none")
+	{
+		policy = NONE;
+	}
+	else if (str == "compact")
+	{
+		policy = COMPACT;
+	}
+	else if (str == "scatter")
+	{
+		policy = SCATTER;
+	}
+	else
+	{
+		policy = EXPLICIT;
+		return parse_cpu_list(str, &cpus);
+	}
+	return true;
+}
+
+std::vector<int> ThreadAffinity::cpu_order() const
+{
+	std::vector<int> order;
+	switch (policy)
+	{
+		case NONE:
+			break;
+		case EXPLICIT:
+			order = cpus;
+			break;
+		case COMPACT:
+			for (auto const& node : numa_nodes())
+			{
+				order.insert(order.end(), node.begin(), node.end());
+			}
+			break;
+		case SCATTER: {
+			auto const nodes = numa_nodes();
+			for (std::size_t i = 0, added = 1; added > 0; ++i)
+			{
+				added = 0;
+				for (auto const& node : nodes)
+				{
+					if (i < node.size())
+					{
+						order.push_back(node[i]);
+						++added;
+					}
+				}
+			}
+			break;
+		}
+	}
+	return order;
+}
+
+// Pin the calling thread to the given cpu.
+static void pin_current_thread(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+	{
+		std::cerr << "[ThreadPool] Cannot pin worker to cpu " << cpu << std::endl;
+	}
+#else
+	(void) cpu;
+#endif
+}
+
+/*
+ * Chase-Lev work-stealing deque with a fixed capacity.
+ *
+ * Only the owning worker calls push() and pop(), which operate on the bottom
+ * end. Any thread may call steal(), which takes the oldest task from the top.
+ * See Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models".
+ */
+class ThreadPool::TaskDeque
+{
+	public:
+		enum { CAPACITY = 1024 };
+
+		TaskDeque() : m_top(0), m_bottom(0), m_buffer(CAPACITY) {}
+
+		// Returns false if the deque is full.
+		bool push(Task* task)
+		{
+			std::int64_t const b = m_bottom.load(std::memory_order_relaxed);
+			std::int64_t const t = m_top.load(std::memory_order_acquire);
+			if (b - t >= CAPACITY)
+			{
+				return false;
+			}
+			m_buffer[b & (CAPACITY-1)].store(task, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		Task* pop()
+		{
+			std::int64_t const b = m_bottom.load(std::memory_order_relaxed) - 1;
+			m_bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t t = m_top.load(std::memory_order_relaxed);
+
+			if (t > b)
+			{
+				// Empty.
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr;
+			}
+
+			Task* task = m_buffer[b & (CAPACITY-1)].load(std::memory_order_relaxed);
+			if (t == b)
+			{
+				// Last element, race against thieves.
+				if (!m_top.compare_exchange_strong(t, t + 1,
+						std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					task = nullptr;
+				}
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return task;
+		}
+
+		Task* steal()
+		{
+			std::int64_t t = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			std::int64_t const b = m_bottom.load(std::memory_order_acquire);
+			if (t >= b)
+			{
+				return nullptr;
+			}
+
+			Task* task = m_buffer[t & (CAPACITY-1)].load(std::memory_order_relaxed);
+			if (!m_top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				return nullptr;
+			}
+			return task;
+		}
+
+	private:
+		alignas(64) std::atomic<std::int64_t> m_top;
+		alignas(64) std::atomic<std::int64_t> m_bottom;
+		std::vector<std::atomic<Task*>>       m_buffer;
+};
+
+struct ThreadPool::Task
+{
+	std::function<void()> fn;
+	TaskGroup*            group;
+	Priority              priority;
+};
+
+// The pool and index of the calling worker thread.
+static thread_local ThreadPool const* current_pool       = nullptr;
+static thread_local int               current_worker     = -1;
+static thread_local std::uint32_t     steal_rng_state    = 1;
+// Tasks picked by the calling worker since its last submitted NORMAL task.
+static thread_local int               tasks_since_normal = 0;
+
+// -----------------------------------------------------------------------------
+
+ThreadPool::TaskGroup::~TaskGroup()
+{
+	cg_assert(m_pending.load() == 0 && bool("TaskGroup destroyed before sync()."));
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(unsigned max_threads, ThreadAffinity const& affinity) :
+	m_numJobs(0), m_jobsDone(0), m_hasException(false), m_batchId(0),
+	m_numQueued(0), m_numInjected(0), m_numSleeping(0), m_numBackground(0),
+	m_shutdown(false), m_previousActive(nullptr)
 {
 	using std::cout;
 	using std::endl;
@@ -19,14 +293,414 @@ ThreadPool::ThreadPool(unsigned max_threads) :
 	cout << "[ThreadPool] " << "Using " << max_threads << " worker threads" << endl;
 	m_threads.resize(max_threads);
 	m_tld.resize(max_threads);
+	m_tldBatch.resize(max_threads, 0);
 	m_terminate.store(true);
+	for (auto& n : m_numSubmitted)
+	{
+		n.store(0);
+	}
+
+	m_cpus = affinity.cpu_order();
+	if (!m_cpus.empty())
+	{
+		cout << "[ThreadPool] " << "Pinning workers to cpus";
+		for (int i = 0; i < std::min<int>(max_threads, m_cpus.size()); ++i)
+		{
+			cout << " " << m_cpus[i];
+		}
+		cout << endl;
+	}
+
+	m_deques.resize(max_threads);
+	for (auto& d : m_deques)
+	{
+		d.reset(new TaskDeque());
+	}
+
+	// Workers are started once and then parked until there is work.
+	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+	{
+		m_threads[i].reset(new std::thread(&ThreadPool::worker_main, this, i));
+	}
 }
 
 // -----------------------------------------------------------------------------
 
 ThreadPool::~ThreadPool()
 {
+	if (active_pool == this)
+	{
+		active_pool = m_previousActive;
+	}
+
 	terminate();
+	sync(m_submittedGroup);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_wakeup.notify_all();
+
+	for (auto& t : m_threads)
+	{
+		if (t && t->joinable())
+		{
+			t->join();
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPool* ThreadPool::active_pool = nullptr;
+
+ThreadPool& ThreadPool::get_active()
+{
+	if (active_pool)
+	{
+		return *active_pool;
+	}
+	static ThreadPool default_pool;
+	return default_pool;
+}
+
+void ThreadPool::set_active()
+{
+	if (active_pool != this)
+	{
+		m_previousActive = active_pool;
+		active_pool = this;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+int ThreadPool::current_thread_id() const
+{
+	return (current_pool == this) ? current_worker : -1;
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::worker_main(int threadId)
+{
+	current_pool    = this;
+	current_worker  = threadId;
+	steal_rng_state = 2654435761u * std::uint32_t(threadId + 1);
+	Profiler::set_thread_name("worker " + std::to_string(threadId));
+
+	if (!m_cpus.empty())
+	{
+		pin_current_thread(m_cpus[threadId % m_cpus.size()]);
+	}
+
+	while (true)
+	{
+		if (Task* task = find_task(threadId))
+		{
+			execute(task);
+			continue;
+		}
+
+		// Park until new tasks are queued.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_numSleeping++;
+		m_wakeup.wait(lock, [&]() { return m_shutdown || has_work(); });
+		m_numSleeping--;
+		if (m_shutdown)
+		{
+			return;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::push_task(Task* task)
+{
+	cg_assert(task && task->group);
+	task->group->m_pending++;
+	m_numQueued++;
+
+	int const threadId = current_thread_id();
+	if (threadId < 0 || !m_deques[threadId]->push(task))
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_injected.push_back(task);
+		m_numInjected++;
+	}
+
+	if (m_numSleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_wakeup.notify_one();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::submit_internal(Priority priority, std::function<void()> fn)
+{
+	cg_assert(priority >= 0 && priority < PRIORITY_COUNT);
+	Task* task = new Task { std::move(fn), &m_submittedGroup, priority };
+	m_submittedGroup.m_pending++;
+
+	if (num_threads() < 1)
+	{
+		execute(task);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_submitted[priority].push_back(task);
+	m_numSubmitted[priority]++;
+	if (m_numSleeping.load() > 0)
+	{
+		m_wakeup.notify_one();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+// Called with m_mutex held.
+bool ThreadPool::has_work() const
+{
+	return m_numQueued.load() > 0
+		|| m_numSubmitted[PRIORITY_INTERACTIVE].load() > 0
+		|| m_numSubmitted[PRIORITY_NORMAL].load() > 0
+		|| (m_numSubmitted[PRIORITY_BACKGROUND].load() > 0 && background_allowed());
+}
+
+// Background tasks only run while the pool would otherwise be idle, and
+// leave one worker free to pick up the next batch right away.
+bool ThreadPool::background_allowed() const
+{
+	return m_numQueued.load() == 0
+		&& m_batch.m_pending.load() == 0
+		&& m_numBackground.load() < std::max(1, num_threads() - 1);
+}
+
+ThreadPool::Task* ThreadPool::pop_submitted(Priority priority)
+{
+	if (m_numSubmitted[priority].load() == 0)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_submitted[priority].empty()
+	 || (priority == PRIORITY_BACKGROUND && !background_allowed()))
+	{
+		return nullptr;
+	}
+
+	Task* task = m_submitted[priority].front();
+	m_submitted[priority].pop_front();
+	m_numSubmitted[priority]--;
+	if (priority == PRIORITY_BACKGROUND)
+	{
+		m_numBackground++;
+	}
+	return task;
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadPool::Task* ThreadPool::find_task(int threadId, bool foreground_only)
+{
+	Task* task = nullptr;
+	if (!foreground_only)
+	{
+		// run() batches and spawned tasks keep refilling the own deque, so
+		// submitted tasks have to be checked before it.
+		task = pop_submitted(PRIORITY_INTERACTIVE);
+		if (task)
+		{
+			return task;
+		}
+		if (++tasks_since_normal >= normal_interleave)
+		{
+			task = pop_submitted(PRIORITY_NORMAL);
+			if (task)
+			{
+				tasks_since_normal = 0;
+				return task;
+			}
+		}
+	}
+
+	if (threadId >= 0)
+	{
+		task = m_deques[threadId]->pop();
+	}
+
+	if (!task && !foreground_only)
+	{
+		task = pop_submitted(PRIORITY_NORMAL);
+		if (task)
+		{
+			tasks_since_normal = 0;
+			return task;
+		}
+	}
+
+	if (!task && m_numInjected.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_injected.empty())
+		{
+			task = m_injected.front();
+			m_injected.pop_front();
+			m_numInjected--;
+		}
+	}
+
+	// Try to steal, starting at a random victim.
+	int const num_deques = static_cast<int>(m_deques.size());
+	if (!task && num_deques > 1 && m_numQueued.load() > 0)
+	{
+		steal_rng_state ^= steal_rng_state << 13;
+		steal_rng_state ^= steal_rng_state >> 17;
+		steal_rng_state ^= steal_rng_state << 5;
+		int const first = static_cast<int>(steal_rng_state % std::uint32_t(num_deques));
+		for (int i = 0; i < num_deques && !task; ++i)
+		{
+			int const victim = (first + i) % num_deques;
+			if (victim != threadId)
+			{
+				task = m_deques[victim]->steal();
+			}
+		}
+	}
+
+	if (task)
+	{
+		m_numQueued--;
+	}
+	else if (!foreground_only)
+	{
+		task = pop_submitted(PRIORITY_BACKGROUND);
+	}
+	return task;
+}
+
+// -----------------------------------------------------------------------------
+
+// The message of the exception currently being handled.
+static std::string current_exception_message()
+{
+	try
+	{
+		throw;
+	} catch (std::exception const& e)
+	{
+		return e.what();
+	} catch(...)
+	{
+		return "unknown exception caught";
+	}
+}
+
+void ThreadPool::execute(Task* task)
+{
+	TaskGroup* group = task->group;
+	try
+	{
+		task->fn();
+	} catch (...)
+	{
+		if (group == &m_batch || group == &m_submittedGroup)
+		{
+			record_exception(current_exception_message());
+		}
+		else if (!group->m_failed.exchange(true))
+		{
+			// Rethrown by sync(), without cancelling the current batch.
+			group->m_exception = std::current_exception();
+		}
+	}
+
+	bool wake_background = false;
+	if (task->priority == PRIORITY_BACKGROUND)
+	{
+		m_numBackground--;
+		wake_background = true;
+	}
+	delete task;
+
+	if (--group->m_pending == 0)
+	{
+		wake_background |= (group == &m_batch);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_idle.notify_all();
+	}
+
+	// Queued background tasks may have become runnable.
+	if (wake_background && m_numSubmitted[PRIORITY_BACKGROUND].load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_wakeup.notify_all();
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::record_exception(std::string const& what)
+{
+	std::lock_guard<std::mutex> guard(m_exceptionMutex);
+	m_hasException.store(true);
+	std::ostringstream os;
+	os << "Thread " << std::this_thread::get_id() << ": " << what;
+	m_exceptionMsg.push_back(os.str());
+	m_numJobs.store(0);
+	m_terminate.store(true);
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::run_range(int begin, int end)
+{
+	int const threadId = current_thread_id();
+	cg_assert(threadId >= 0);
+
+	// Thread local data is allocated by the worker that uses it, so that
+	// first-touch places it in memory local to the worker's NUMA node.
+	if (m_tldBatch[threadId] != m_batchId)
+	{
+		m_tldAlloc(threadId, m_tld[threadId]);
+		m_tldBatch[threadId] = m_batchId;
+	}
+
+	while (begin < end && !m_terminate.load())
+	{
+		// Keep the upper half of the range available for thieves. Popping
+		// from our own deque later continues right after the current job.
+		while (end - begin > 1)
+		{
+			int const mid = begin + (end - begin) / 2;
+			push_task(new Task { [this, mid, end]() { run_range(mid, end); }, &m_batch, PRIORITY_NORMAL });
+			end = mid;
+		}
+
+		if (begin >= m_numJobs.load())
+		{
+			return;
+		}
+
+		try 
+		{
+			m_kernel(begin, m_tld[threadId].get(), m_terminate);
+		} catch (std::exception const& e)
+		{
+			record_exception(e.what());
+		} catch(...)
+		{
+			record_exception("unknown exception caught");
+		}
+		m_jobsDone++;
+		++begin;
+	}
 }
 
 // -----------------------------------------------------------------------------
@@ -40,82 +714,85 @@ void ThreadPool::run_internal(
 	cg_assert(num_jobs >= 0);
 	terminate();
 
-	// Set up data for jobs.
-	m_currentJob.store(0);
+	// Set up data for jobs. No job of the previous batch is running anymore.
 	m_kernel = kernel;
+	m_tldAlloc = tldAlloc;
 	m_numJobs.store(num_jobs);
 	m_jobsDone.store(0);
 	m_terminate.store(false);
 	m_hasException.store(false);
 	m_exceptionMsg.clear();
+	++m_batchId;
 
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+	// Hand out one contiguous range of jobs per worker.
+	for (int i = 0; i < num_threads(); ++i)
 	{
-		tldAlloc(i, m_tld[i]);
+		int const begin = static_cast<int>(std::int64_t(num_jobs) * i       / num_threads());
+		int const end   = static_cast<int>(std::int64_t(num_jobs) * (i + 1) / num_threads());
+		if (begin < end)
+		{
+			push_task(new Task { [this, begin, end]() { run_range(begin, end); }, &m_batch, PRIORITY_NORMAL });
+		}
 	}
+}
+
+// -----------------------------------------------------------------------------
 
-	auto thread_func = [&](int threadId) 
+void ThreadPool::spawn(TaskGroup& group, std::function<void()> task)
+{
+	push_task(new Task { std::move(task), &group, PRIORITY_NORMAL });
+}
+
+// -----------------------------------------------------------------------------
+
+void ThreadPool::sync(TaskGroup& group)
+{
+	int const threadId = current_thread_id();
+	if (threadId >= 0)
 	{
-		while (true)
+		// Help out instead of blocking the worker.
+		while (group.m_pending.load() > 0)
 		{
-			int const jobId = m_currentJob++;
-			if (jobId >= m_numJobs.load())
+			if (Task* task = find_task(threadId, true))
 			{
-				return;
+				execute(task);
 			}
-
-			try 
-			{
-				m_kernel(jobId, m_tld[threadId].get(), m_terminate);
-			} catch (std::exception const& e)
+			else
 			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << e.what();
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
-			} catch(...)
-			{
-				std::lock_guard<std::mutex> guard(m_exceptionMutex);
-				m_hasException.store(true);
-				std::ostringstream os;
-				os << "Thread " << std::this_thread::get_id() << ": " << "unknown exception caught";
-				m_exceptionMsg.push_back(os.str());
-				m_numJobs.store(0);
-				m_terminate.store(true);
+				std::this_thread::yield();
 			}
-			m_jobsDone++;
-			std::this_thread::yield();
 		}
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle.wait(lock, [&]() { return group.m_pending.load() == 0; });
+	}
 
-		m_tld[threadId].reset();
-	};
-
-	// Launch threads.
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
+	if (group.m_failed.load())
 	{
-		m_threads[i].reset(new std::thread(thread_func, i));
+		std::exception_ptr const exception = group.m_exception;
+		group.m_exception = nullptr;
+		group.m_failed.store(false);
+		std::rethrow_exception(exception);
 	}
 }
 
 // -----------------------------------------------------------------------------
 
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [&]() { return m_batch.m_pending.load() == 0; });
+}
+
+// -----------------------------------------------------------------------------
+
 void ThreadPool::terminate() 
 {
 	m_numJobs.store(0);
 	m_terminate.store(true);
-	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
-	{
-		auto& t = m_threads[i];
-		if (t && t->joinable())
-		{
-			t->join();
-		}
-		t.reset();
-		m_tld[i].reset();
-	}
+	wait();
 }
 
 // -----------------------------------------------------------------------------
@@ -128,6 +805,13 @@ void ThreadPool::force_kill()
 	// Give some chance to threads to terminate gracefully.
 	m_numJobs.store(0);
 	m_terminate.store(true);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	// Killed workers will never report back.
+	m_batch.m_pending.store(0);
+	m_submittedGroup.m_pending.store(0);
 
 	for (int i = 0; i < static_cast<int>(m_threads.size()); ++i)
 	{
@@ -4,24 +4,241 @@
 #include <cglib/rt/intersection.h>
 #include <cglib/rt/triangle_soup.h>
 #include <cglib/rt/interpolate.h>
+#include <cglib/rt/raytracing_parameters.h>
 
 #include <cglib/core/camera.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/profiler.h>
+#include <cglib/core/timer.h>
+
+#include <algorithm>
 
 BVH::
-BVH(const TriangleSoup &triangle_soup_)
+BVH(const TriangleSoup &triangle_soup_, int builder_)
 	: triangle_soup(triangle_soup_)
-	, triangle_indices(triangle_soup_.num_triangles)
-	, nodes(1)
 {
+	rebuild(builder_);
+}
+
+void BVH::
+rebuild(int builder_)
+{
+	builder = builder_;
+	triangle_indices.resize(triangle_soup.num_triangles);
+	nodes.assign(1, Node());
+
+	Timer timer;
+	timer.start();
 	nodes.reserve(triangle_soup.num_triangles * 2);
 	for(int i = 0; i < triangle_soup.num_triangles; i++)
 		triangle_indices[i] = i;
-	build_bvh(0, 0, triangle_soup.num_triangles, 0);
+	if (builder == RaytracingParameters::BVH_BUILDER_SAH)
+		build_bvh_sah();
+	else if (builder == RaytracingParameters::BVH_BUILDER_LBVH)
+		build_bvh_linear(false);
+	else if (builder == RaytracingParameters::BVH_BUILDER_TRBVH)
+		build_bvh_linear(true);
+	else
+		build_bvh(0, 0, triangle_soup.num_triangles, 0);
+	build_leaf_triangles();
+	build_compact_bvh();
+	build_wide_bvh();
+	timer.stop();
+	build_time_ms = timer.getElapsedTimeInMilliSec();
 
 	sanity_checks();
 
+	static char const* const builder_names[RaytracingParameters::BVH_BUILDER_COUNT] = {
+		"median", "binned SAH", "linear", "linear + treelet"
+	};
 	auto sah = surface_area_heuristic(0);
-	std::cout << "SAH: " << sah << std::endl;
+	std::cout << "SAH: " << sah 
+		<< " (" << builder_names[std::clamp(builder, 0, RaytracingParameters::BVH_BUILDER_COUNT - 1)]
+		<< " build, " << nodes.size() << " nodes, " << build_time_ms << " ms)" << std::endl;
+}
+
+// -----------------------------------------------------------------------------
+
+namespace {
+
+// Bounds and centers of all triangles, indexed by triangle.
+struct SahInput
+{
+	std::vector<AABB>      bounds;
+	std::vector<glm::vec3> centers;
+};
+
+float surface_area(AABB const& aabb)
+{
+	glm::vec3 const d = aabb.max - aabb.min;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void merge(AABB* aabb, AABB const& other)
+{
+	aabb->min = glm::min(aabb->min, other.min);
+	aabb->max = glm::max(aabb->max, other.max);
+}
+
+/*
+ * Split the node with the triangles [first, first + num) of
+ * bvh.triangle_indices, or make it a leaf. The costs are the ones of
+ * BVH::surface_area_heuristic(): 1 per inner node and 1 per triangle.
+ */
+void build_sah_node(BVH& bvh, SahInput const& input, int node_idx, int first, int num)
+{
+	AABB bounds, center_bounds;
+	for (int i = first; i < first + num; ++i)
+	{
+		int const t = bvh.triangle_indices[i];
+		merge(&bounds, input.bounds[t]);
+		center_bounds.min = glm::min(center_bounds.min, input.centers[t]);
+		center_bounds.max = glm::max(center_bounds.max, input.centers[t]);
+	}
+
+	BVH::Node& node = bvh.nodes[node_idx];
+	node.aabb          = bounds;
+	node.triangle_idx  = first;
+	node.num_triangles = num;
+	node.left          = -1;
+	node.right         = -1;
+
+	if (num == 1)
+	{
+		return;
+	}
+
+	// Find the cheapest split between two bins along any axis.
+	int const num_bins = BVH::SAH_BINS;
+	float const area   = surface_area(bounds);
+	float best_cost    = FLT_MAX;
+	int   best_axis    = -1;
+	int   best_split   = 0;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float const extent = center_bounds.max[axis] - center_bounds.min[axis];
+		if (!(extent > 0.f))
+		{
+			continue;
+		}
+
+		AABB bin_bounds[num_bins];
+		int  bin_count[num_bins] = {};
+		float const scale = float(num_bins) * (1.f - 1e-6f) / extent;
+		for (int i = first; i < first + num; ++i)
+		{
+			int const t = bvh.triangle_indices[i];
+			int const b = std::min(num_bins - 1, int((input.centers[t][axis] - center_bounds.min[axis]) * scale));
+			merge(&bin_bounds[b], input.bounds[t]);
+			bin_count[b]++;
+		}
+
+		// Right side of the split before bin s, for s = 1 .. num_bins - 1.
+		float right_cost[num_bins] = {};
+		AABB  right;
+		int   right_count = 0;
+		for (int s = num_bins - 1; s > 0; --s)
+		{
+			merge(&right, bin_bounds[s]);
+			right_count += bin_count[s];
+			right_cost[s] = right_count > 0 ? surface_area(right) * float(right_count) : -1.f;
+		}
+
+		AABB left;
+		int  left_count = 0;
+		for (int s = 1; s < num_bins; ++s)
+		{
+			merge(&left, bin_bounds[s - 1]);
+			left_count += bin_count[s - 1];
+			if (left_count == 0 || right_cost[s] < 0.f)
+			{
+				continue;
+			}
+			float const cost = 1.f + (surface_area(left) * float(left_count) + right_cost[s]) / area;
+			if (cost < best_cost)
+			{
+				best_cost  = cost;
+				best_axis  = axis;
+				best_split = s;
+			}
+		}
+	}
+
+	// A node small enough for a leaf becomes one unless a split is
+	// cheaper. Larger nodes are always split; if all their centers
+	// coincide, any split is as good as another.
+	if (num <= BVH::MAX_TRIANGLES_IN_LEAF && (best_axis < 0 || best_cost >= float(num)))
+	{
+		return;
+	}
+
+	int num_left = num / 2;
+	if (best_axis >= 0)
+	{
+		int const axis = best_axis;
+		float const scale = float(num_bins) * (1.f - 1e-6f) / (center_bounds.max[axis] - center_bounds.min[axis]);
+		auto const begin = bvh.triangle_indices.begin() + first;
+		auto const mid = std::partition(begin, begin + num, [&](int t)
+			{
+				int const b = std::min(num_bins - 1, int((input.centers[t][axis] - center_bounds.min[axis]) * scale));
+				return b < best_split;
+			});
+		num_left = int(mid - begin);
+	}
+
+	int const left_idx = int(bvh.nodes.size());
+	bvh.nodes.resize(left_idx + 2);
+	bvh.nodes[node_idx].left  = left_idx;
+	bvh.nodes[node_idx].right = left_idx + 1;
+	build_sah_node(bvh, input, left_idx,     first,            num_left);
+	build_sah_node(bvh, input, left_idx + 1, first + num_left, num - num_left);
+}
+
+} // namespace
+
+/*
+ * Build the BVH with the surface area heuristic: every node is split where
+ * the expected cost of a ray traversing it is lowest, estimated from the
+ * triangle centers binned along each axis. A node of at most
+ * MAX_TRIANGLES_IN_LEAF triangles becomes a leaf once no split is cheaper
+ * than intersecting all its triangles; larger nodes are always split.
+ */
+void BVH::
+build_bvh_sah()
+{
+	if (triangle_soup.num_triangles == 0)
+	{
+		return;
+	}
+
+	SahInput input;
+	input.bounds.resize(triangle_soup.num_triangles);
+	input.centers.resize(triangle_soup.num_triangles);
+	for (int t = 0; t < triangle_soup.num_triangles; ++t)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			input.bounds[t].extend(triangle_soup.vertices[t * 3 + j]);
+		}
+		input.centers[t] = 0.5f * (input.bounds[t].min + input.bounds[t].max);
+	}
+	build_sah_node(*this, input, 0, 0, triangle_soup.num_triangles);
+}
+
+void BVH::
+build_leaf_triangles()
+{
+	leaf_triangles.resize(triangle_indices.size());
+	parallel_for(ThreadPool::get_active(), 0, int(triangle_indices.size()), [&](int i)
+	{
+		int const x = triangle_indices[i];
+		glm::vec3 const& v0 = triangle_soup.vertices[x * 3 + 0];
+		leaf_triangles[i] = {
+			v0,
+			triangle_soup.vertices[x * 3 + 1] - v0,
+			triangle_soup.vertices[x * 3 + 2] - v0,
+		};
+	});
 }
 
 bool BVH::
@@ -33,6 +250,12 @@ intersect_local(Ray const& ray, Intersection* isect) const
 	if(!nodes[0].aabb.intersect(ray, t_min, t_max))
 		return false;
 
+	if (traversal == RaytracingParameters::BVH_TRAVERSAL_WIDE && !wide_nodes.empty())
+		return intersect_wide(ray, &t_max, isect);
+	if (traversal == RaytracingParameters::BVH_TRAVERSAL_COMPACT && !compact_nodes.empty())
+		return intersect_compact(ray, &t_max, isect);
+	// The recursive traversal is exercise code, so only its root is counted.
+	CG_PROFILE_COUNT(BVH_NODE_VISITS, 1);
 	return intersect_recursive(ray, 0, &t_max, isect);
 }
 
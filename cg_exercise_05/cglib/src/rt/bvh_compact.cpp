@@ -0,0 +1,207 @@
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/intersection_tests.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/profiler.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+/*
+ * Compact BVH.
+ *
+ * The same tree as BVH::nodes, in 32 byte nodes, so that two of them share
+ * a cache line. The traversal keeps a small stack of far children instead
+ * of recursing, and computes the inverse ray direction and its signs once
+ * per ray: with the signs known, the near and far slab of every axis are
+ * selected directly instead of sorted with min and max.
+ */
+
+static_assert(sizeof(BVH::CompactNode) == 32, "compact BVH nodes must fit into 32 bytes");
+
+// Traversal stack size. Every inner node on the path from the root pushes
+// at most one far child.
+static int const compact_stack_size = 128;
+
+// Set in CompactNode::axis if the right child lies before the left one.
+static std::uint16_t const compact_right_first = 4;
+
+namespace {
+
+struct CompactBuild
+{
+	BVH& bvh;
+	int  max_depth = 0;
+
+	void flatten(int binary, int depth)
+	{
+		max_depth = std::max(max_depth, depth);
+
+		BVH::Node const& node = bvh.nodes[binary];
+		int const compact = int(bvh.compact_nodes.size());
+		bvh.compact_nodes.emplace_back();
+		{
+			BVH::CompactNode& c = bvh.compact_nodes[compact];
+			for (int i = 0; i < 3; ++i)
+			{
+				c.min[i] = node.aabb.min[i];
+				c.max[i] = node.aabb.max[i];
+			}
+			c.count = 0;
+			c.axis  = 0;
+			if (node.left < 0)
+			{
+				c.first_triangle = node.triangle_idx;
+				c.count          = std::uint16_t(node.num_triangles);
+				return;
+			}
+		}
+
+		// Order the children along the axis that separates their centers
+		// most.
+		AABB const& left  = bvh.nodes[node.left].aabb;
+		AABB const& right = bvh.nodes[node.right].aabb;
+		glm::vec3 const d = (right.min + right.max) - (left.min + left.max);
+		int axis = 0;
+		for (int i = 1; i < 3; ++i)
+		{
+			if (std::abs(d[i]) > std::abs(d[axis]))
+			{
+				axis = i;
+			}
+		}
+
+		flatten(node.left, depth + 1);
+		int const right_child = int(bvh.compact_nodes.size());
+		flatten(node.right, depth + 1);
+
+		BVH::CompactNode& c = bvh.compact_nodes[compact];
+		c.right_child = right_child;
+		c.axis        = std::uint16_t(axis | (d[axis] < 0.f ? compact_right_first : 0));
+	}
+};
+
+} // namespace
+
+void BVH::
+build_compact_bvh()
+{
+	compact_nodes.clear();
+	if (nodes.empty() || nodes[0].num_triangles <= 0)
+	{
+		return;
+	}
+	for (Node const& node : nodes)
+	{
+		if (node.left < 0 && node.num_triangles > std::numeric_limits<std::uint16_t>::max())
+		{
+			std::cerr << "BVH leaf with " << node.num_triangles
+				<< " triangles too large for compact traversal, using the recursive traversal" << std::endl;
+			return;
+		}
+	}
+	compact_nodes.reserve(nodes.size());
+	CompactBuild build = { *this };
+	build.flatten(0, 0);
+
+	if (build.max_depth + 1 > compact_stack_size)
+	{
+		std::cerr << "BVH too deep for compact traversal (depth " << build.max_depth
+			<< "), using the recursive traversal" << std::endl;
+		compact_nodes.clear();
+	}
+}
+
+/*
+ * Intersect the compact BVH iteratively, returning the nearest
+ * intersection closer than *t_max if there is one.
+ */
+bool BVH::
+intersect_compact(const Ray &ray, float *t_max, Intersection* isect) const
+{
+	cg_assert(t_max);
+	glm::vec3 const inv_dir = 1.f / ray.direction;
+	int const sign[3] = {
+		inv_dir.x < 0.f ? 1 : 0,
+		inv_dir.y < 0.f ? 1 : 0,
+		inv_dir.z < 0.f ? 1 : 0,
+	};
+
+	int stack[compact_stack_size];
+	int sp = 0;
+	int current = 0;
+
+	float     nearest = *t_max;
+	int       nearest_triangle = -1;
+	glm::vec3 nearest_bary(0.f);
+	for (;;)
+	{
+		CompactNode const& node = compact_nodes[current];
+		CG_PROFILE_COUNT(BVH_NODE_VISITS, 1);
+
+		float const t_near = std::max(
+			std::max(((sign[0] ? node.max[0] : node.min[0]) - ray.origin.x) * inv_dir.x,
+			         ((sign[1] ? node.max[1] : node.min[1]) - ray.origin.y) * inv_dir.y),
+			std::max(((sign[2] ? node.max[2] : node.min[2]) - ray.origin.z) * inv_dir.z, 0.f));
+		float const t_far = std::min(
+			std::min(((sign[0] ? node.min[0] : node.max[0]) - ray.origin.x) * inv_dir.x,
+			         ((sign[1] ? node.min[1] : node.max[1]) - ray.origin.y) * inv_dir.y),
+			std::min(((sign[2] ? node.min[2] : node.max[2]) - ray.origin.z) * inv_dir.z, nearest));
+
+		if (t_near <= t_far)
+		{
+			if (node.count == 0)
+			{
+				// Continue with the near child, visit the far one later.
+				bool const right_first = (sign[node.axis & 3] != 0) != ((node.axis & compact_right_first) != 0);
+				if (right_first)
+				{
+					stack[sp++] = current + 1;
+					current     = node.right_child;
+				}
+				else
+				{
+					stack[sp++] = node.right_child;
+					current     = current + 1;
+				}
+				continue;
+			}
+
+			CG_PROFILE_COUNT(TRIANGLE_TESTS, node.count);
+			LeafTriangle const* const triangles = &leaf_triangles[node.first_triangle];
+			for (int i = 0; i < node.count; ++i)
+			{
+				float dist;
+				glm::vec3 b;
+				if (intersect_triangle_edges(ray.origin, ray.direction,
+							triangles[i].v0, triangles[i].edge1, triangles[i].edge2,
+							b, dist) && dist <= nearest)
+				{
+					nearest          = dist;
+					nearest_triangle = node.first_triangle + i;
+					nearest_bary     = b;
+				}
+			}
+		}
+
+		if (sp == 0)
+		{
+			break;
+		}
+		current = stack[--sp];
+	}
+
+	if (nearest_triangle < 0)
+	{
+		return false;
+	}
+	*t_max = nearest;
+	if (isect)
+	{
+		triangle_soup.fill_intersection(isect, triangle_indices[nearest_triangle], nearest, nearest_bary);
+	}
+	return true;
+}
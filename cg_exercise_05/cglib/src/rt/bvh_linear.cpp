@@ -0,0 +1,394 @@
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/parallel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+
+/*
+ * Linear BVH construction (Karras, "Maximizing Parallelism in the
+ * Construction of BVHs, Octrees, and k-d Trees", HPG 2012):
+ *
+ * 1. Quantize the triangle centers to 10 bits per axis and interleave them
+ *    to 30 bit Morton codes.
+ * 2. Radix sort the triangles by their codes.
+ * 3. Emit all inner nodes of the binary radix tree over the sorted codes
+ *    at once, every node finds its range and split independently. Then
+ *    compute the bounds from the leaves up: of the two threads arriving at
+ *    a node, the second one continues.
+ *
+ * Restructuring optionally improves the tree during the bottom-up pass
+ * (Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+ * Volume Hierarchies", HPG 2013): the treelet of up to seven subtrees below
+ * every node is rearranged into the topology of lowest SAH cost.
+ *
+ * Finally, the tree is copied to BVH::nodes in depth first order, and
+ * subtrees of at most MAX_TRIANGLES_IN_LEAF triangles become leaves.
+ */
+
+namespace {
+
+// Nodes of the binary radix tree. Inner nodes are [0, n - 1), the leaf of
+// the k-th sorted triangle is n - 1 + k. The root is inner node 0.
+struct RadixTree
+{
+	int              num_triangles = 0;
+	std::vector<int> left, right, parent;
+	std::vector<int> count;
+	std::vector<AABB> bounds;
+	// SAH cost without normalization: surface area times
+	// BVH::surface_area_heuristic().
+	std::vector<float> cost;
+
+	bool is_leaf(int node) const { return node >= num_triangles - 1; }
+};
+
+float surface_area(AABB const& aabb)
+{
+	glm::vec3 const d = aabb.max - aabb.min;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB merged(AABB a, AABB const& b)
+{
+	a.min = glm::min(a.min, b.min);
+	a.max = glm::max(a.max, b.max);
+	return a;
+}
+
+// Spread the lowest 10 bits of v to every third bit.
+std::uint32_t expand_bits(std::uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xff0000ffu;
+	v = (v * 0x00000101u) & 0x0f00f00fu;
+	v = (v * 0x00000011u) & 0xc30c30c3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+std::uint32_t morton_code(glm::vec3 const& p)
+{
+	glm::uvec3 const q = glm::uvec3(glm::clamp(p * 1024.f, glm::vec3(0.f), glm::vec3(1023.f)));
+	return (expand_bits(q.x) << 2) | (expand_bits(q.y) << 1) | expand_bits(q.z);
+}
+
+// Length of the common prefix of the codes of sorted triangles i and j, or
+// -1 if j is out of range. Equal codes are told apart by their index.
+int common_prefix(std::vector<std::uint32_t> const& codes, int i, int j)
+{
+	if (j < 0 || j >= int(codes.size()))
+	{
+		return -1;
+	}
+	if (codes[i] == codes[j])
+	{
+		return 32 + std::countl_zero(std::uint32_t(i ^ j));
+	}
+	return std::countl_zero(codes[i] ^ codes[j]);
+}
+
+// Finds the range and the split of inner node i.
+void emit_inner_node(RadixTree* tree, std::vector<std::uint32_t> const& codes, int i)
+{
+	// The direction of the range: towards the neighbour with the longer
+	// common prefix.
+	int const d = common_prefix(codes, i, i + 1) > common_prefix(codes, i, i - 1) ? 1 : -1;
+
+	// Find the other end with an exponential, then a binary search.
+	int const prefix_min = common_prefix(codes, i, i - d);
+	int length_max = 2;
+	while (common_prefix(codes, i, i + length_max * d) > prefix_min)
+	{
+		length_max *= 2;
+	}
+	int length = 0;
+	for (int t = length_max / 2; t >= 1; t /= 2)
+	{
+		if (common_prefix(codes, i, i + (length + t) * d) > prefix_min)
+		{
+			length += t;
+		}
+	}
+	int const j = i + length * d;
+
+	// The split is where the common prefix of the range ends.
+	int const prefix_node = common_prefix(codes, i, j);
+	int split = 0;
+	int t = length;
+	do
+	{
+		t = (t + 1) / 2;
+		if (common_prefix(codes, i, i + (split + t) * d) > prefix_node)
+		{
+			split += t;
+		}
+	} while (t > 1);
+	int const gamma = i + split * d + std::min(d, 0);
+
+	int const n = tree->num_triangles;
+	int const left  = std::min(i, j) == gamma     ? n - 1 + gamma     : gamma;
+	int const right = std::max(i, j) == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+	tree->left[i]  = left;
+	tree->right[i] = right;
+	tree->parent[left]  = i;
+	tree->parent[right] = i;
+}
+
+void update_inner_node(RadixTree* tree, int node)
+{
+	int const l = tree->left[node];
+	int const r = tree->right[node];
+	tree->bounds[node] = merged(tree->bounds[l], tree->bounds[r]);
+	tree->count[node]  = tree->count[l] + tree->count[r];
+	tree->cost[node]   = surface_area(tree->bounds[node]) + tree->cost[l] + tree->cost[r];
+}
+
+/*
+ * Rearrange the treelet below root into the topology with the lowest SAH
+ * cost. The treelet is grown by repeatedly replacing its largest inner
+ * leaf by its two children, and the best topology over its leaves is found
+ * by dynamic programming over all subsets.
+ */
+void restructure_treelet(RadixTree* tree, int root)
+{
+	int const max_leaves = 7;
+	int leaves[max_leaves];
+	int inner[max_leaves];
+	int num_leaves = 2;
+	int num_inner  = 0;
+	leaves[0] = tree->left[root];
+	leaves[1] = tree->right[root];
+	while (num_leaves < max_leaves)
+	{
+		int largest = -1;
+		float largest_area = -1.f;
+		for (int k = 0; k < num_leaves; ++k)
+		{
+			float const area = surface_area(tree->bounds[leaves[k]]);
+			if (!tree->is_leaf(leaves[k]) && area > largest_area)
+			{
+				largest = k;
+				largest_area = area;
+			}
+		}
+		if (largest < 0)
+		{
+			break;
+		}
+		int const node = leaves[largest];
+		inner[num_inner++] = node;
+		leaves[largest] = tree->left[node];
+		leaves[num_leaves++] = tree->right[node];
+	}
+	if (num_leaves < 3)
+	{
+		return;
+	}
+
+	// Best cost and split of every subset of the treelet leaves.
+	int const num_subsets = 1 << num_leaves;
+	AABB  bounds[1 << max_leaves];
+	float cost[1 << max_leaves];
+	int   best_split[1 << max_leaves];
+	for (int s = 1; s < num_subsets; ++s)
+	{
+		int const low = s & -s;
+		if (s == low)
+		{
+			int const k = std::countr_zero(std::uint32_t(s));
+			bounds[s] = tree->bounds[leaves[k]];
+			cost[s]   = tree->cost[leaves[k]];
+			continue;
+		}
+		bounds[s] = merged(bounds[s & ~low], bounds[low]);
+
+		// Every split with its lowest leaf on the left side.
+		float best = FLT_MAX;
+		int split = 0;
+		for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+		{
+			if ((p & low) && cost[p] + cost[s & ~p] < best)
+			{
+				best  = cost[p] + cost[s & ~p];
+				split = p;
+			}
+		}
+		cost[s]       = surface_area(bounds[s]) + best;
+		best_split[s] = split;
+	}
+
+	int const all = num_subsets - 1;
+	if (!(cost[all] < tree->cost[root]))
+	{
+		return;
+	}
+
+	// Rebuild the treelet with the same inner nodes.
+	struct Rebuild
+	{
+		RadixTree*  tree;
+		int const*  leaves;
+		int const*  inner;
+		int const*  best_split;
+		int         next_inner;
+
+		int build(int s, int node)
+		{
+			int const p = best_split[s];
+			int const children[2] = { p, s & ~p };
+			int child_nodes[2];
+			for (int c = 0; c < 2; ++c)
+			{
+				int const sub = children[c];
+				if ((sub & (sub - 1)) == 0)
+				{
+					child_nodes[c] = leaves[std::countr_zero(std::uint32_t(sub))];
+				}
+				else
+				{
+					child_nodes[c] = build(sub, inner[next_inner++]);
+				}
+				tree->parent[child_nodes[c]] = node;
+			}
+			tree->left[node]  = child_nodes[0];
+			tree->right[node] = child_nodes[1];
+			update_inner_node(tree, node);
+			return node;
+		}
+	};
+	Rebuild rebuild = { tree, leaves, inner, best_split, 0 };
+	rebuild.build(all, root);
+}
+
+} // namespace
+
+void BVH::
+build_bvh_linear(bool restructure)
+{
+	int const n = triangle_soup.num_triangles;
+	if (n == 0)
+	{
+		return;
+	}
+	ThreadPool& pool = ThreadPool::get_active();
+
+	// Triangle bounds and centers.
+	std::vector<AABB> triangle_bounds(n);
+	parallel_for(pool, 0, n, [&](int t)
+		{
+			for (int j = 0; j < 3; ++j)
+			{
+				triangle_bounds[t].extend(triangle_soup.vertices[t * 3 + j]);
+			}
+		});
+	AABB const center_bounds = parallel_reduce(pool, 0, n, AABB(),
+		[&](int t)
+		{
+			glm::vec3 const c = 0.5f * (triangle_bounds[t].min + triangle_bounds[t].max);
+			AABB b;
+			b.min = b.max = c;
+			return b;
+		},
+		[](AABB const& a, AABB const& b) { return merged(a, b); });
+
+	// 1. Morton codes, 2. sort.
+	glm::vec3 const extent = glm::max(center_bounds.max - center_bounds.min, glm::vec3(1e-20f));
+	std::vector<std::uint32_t> codes(n);
+	std::vector<int> order(n);
+	parallel_for(pool, 0, n, [&](int t)
+		{
+			glm::vec3 const c = 0.5f * (triangle_bounds[t].min + triangle_bounds[t].max);
+			codes[t] = morton_code((c - center_bounds.min) / extent);
+			order[t] = t;
+		});
+	parallel_radix_sort(pool, &codes, &order, 30);
+
+	// 3. Radix tree and bounds.
+	RadixTree tree;
+	tree.num_triangles = n;
+	tree.left.assign(2 * n - 1, -1);
+	tree.right.assign(2 * n - 1, -1);
+	tree.parent.assign(2 * n - 1, -1);
+	tree.count.resize(2 * n - 1);
+	tree.bounds.resize(2 * n - 1);
+	tree.cost.resize(2 * n - 1);
+	parallel_for(pool, 0, n - 1, [&](int i)
+		{
+			emit_inner_node(&tree, codes, i);
+		});
+
+	std::unique_ptr<std::atomic<int>[]> arrivals(new std::atomic<int>[std::max(1, n - 1)]);
+	parallel_for(pool, 0, n - 1, [&](int i)
+		{
+			arrivals[i].store(0, std::memory_order_relaxed);
+		});
+	parallel_for(pool, 0, n, [&](int k)
+		{
+			int const leaf = n - 1 + k;
+			tree.bounds[leaf] = triangle_bounds[order[k]];
+			tree.count[leaf]  = 1;
+			tree.cost[leaf]   = surface_area(tree.bounds[leaf]);
+
+			// Only the second thread to arrive sees both children.
+			for (int node = tree.parent[leaf]; node >= 0; node = tree.parent[node])
+			{
+				if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+				{
+					break;
+				}
+				update_inner_node(&tree, node);
+				if (restructure)
+				{
+					restructure_treelet(&tree, node);
+				}
+			}
+		});
+
+	// Copy to the final layout.
+	nodes.clear();
+	triangle_indices.clear();
+	struct Copy
+	{
+		BVH&                    bvh;
+		RadixTree const&        tree;
+		std::vector<int> const& order;
+
+		void leaves(int node)
+		{
+			if (tree.is_leaf(node))
+			{
+				bvh.triangle_indices.push_back(order[node - (tree.num_triangles - 1)]);
+				return;
+			}
+			leaves(tree.left[node]);
+			leaves(tree.right[node]);
+		}
+
+		void copy(int from, int to)
+		{
+			Node& node = bvh.nodes[to];
+			node.aabb          = tree.bounds[from];
+			node.num_triangles = tree.count[from];
+			node.triangle_idx  = int(bvh.triangle_indices.size());
+			if (tree.is_leaf(from) || tree.count[from] <= MAX_TRIANGLES_IN_LEAF)
+			{
+				node.left = node.right = -1;
+				leaves(from);
+				return;
+			}
+			int const children = int(bvh.nodes.size());
+			bvh.nodes.resize(children + 2);
+			bvh.nodes[to].left  = children;
+			bvh.nodes[to].right = children + 1;
+			copy(tree.left[from],  children);
+			copy(tree.right[from], children + 1);
+		}
+	};
+	nodes.resize(1);
+	Copy copy = { *this, tree, order };
+	copy.copy(n > 1 ? 0 : n - 1, 0);
+}
@@ -0,0 +1,275 @@
+#include <cglib/rt/bvh.h>
+#include <cglib/rt/intersection.h>
+#include <cglib/rt/intersection_tests.h>
+#include <cglib/rt/triangle_soup.h>
+
+#include <cglib/core/profiler.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#  define CG_BVH_SSE 1
+#  include <xmmintrin.h>
+#endif
+
+/*
+ * 4-wide BVH.
+ *
+ * Every wide node replaces up to three levels of the binary tree: starting
+ * with the two children of a binary node, the child with the largest
+ * surface area is replaced by its own children until there are four. The
+ * traversal then tests the ray against all four boxes at once, and visits
+ * the children that were hit in front to back order of their entry
+ * distances.
+ */
+
+// Traversal stack size. Every visited node pushes at most WIDTH - 1
+// entries more than it pops.
+static int const wide_stack_size = 256;
+
+namespace {
+
+float surface_area(AABB const& aabb)
+{
+	glm::vec3 const d = aabb.max - aabb.min;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+struct WideBuild
+{
+	BVH& bvh;
+	int  max_depth = 0;
+
+	void collapse(int binary, int wide, int depth)
+	{
+		max_depth = std::max(max_depth, depth);
+
+		int children[BVH::WideNode::WIDTH];
+		int num_children = 0;
+		BVH::Node const& node = bvh.nodes[binary];
+		if (node.left < 0)
+		{
+			// Only a leaf root gets here.
+			children[num_children++] = binary;
+		}
+		else
+		{
+			children[num_children++] = node.left;
+			children[num_children++] = node.right;
+		}
+		while (num_children < BVH::WideNode::WIDTH)
+		{
+			int largest = -1;
+			float largest_area = -1.f;
+			for (int k = 0; k < num_children; ++k)
+			{
+				BVH::Node const& child = bvh.nodes[children[k]];
+				float const area = surface_area(child.aabb);
+				if (child.left >= 0 && area > largest_area)
+				{
+					largest = k;
+					largest_area = area;
+				}
+			}
+			if (largest < 0)
+			{
+				break;
+			}
+			BVH::Node const& open = bvh.nodes[children[largest]];
+			children[largest]        = open.left;
+			children[num_children++] = open.right;
+		}
+
+		for (int k = 0; k < BVH::WideNode::WIDTH; ++k)
+		{
+			BVH::WideNode& w = bvh.wide_nodes[wide];
+			if (k >= num_children)
+			{
+				w.min_x[k] = w.min_y[k] = w.min_z[k] =  std::numeric_limits<float>::max();
+				w.max_x[k] = w.max_y[k] = w.max_z[k] = -std::numeric_limits<float>::max();
+				w.child[k] = -1;
+				w.count[k] = -1;
+				continue;
+			}
+			BVH::Node const& child = bvh.nodes[children[k]];
+			w.min_x[k] = child.aabb.min.x; w.max_x[k] = child.aabb.max.x;
+			w.min_y[k] = child.aabb.min.y; w.max_y[k] = child.aabb.max.y;
+			w.min_z[k] = child.aabb.min.z; w.max_z[k] = child.aabb.max.z;
+			if (child.left < 0)
+			{
+				w.child[k] = child.triangle_idx;
+				w.count[k] = child.num_triangles;
+			}
+			else
+			{
+				int const next = int(bvh.wide_nodes.size());
+				bvh.wide_nodes.emplace_back();
+				bvh.wide_nodes[wide].child[k] = next;
+				bvh.wide_nodes[wide].count[k] = 0;
+				collapse(children[k], next, depth + 1);
+			}
+		}
+	}
+};
+
+// Entry and exit distances of the ray for all children of the node.
+// Returns a bit mask of the children hit in [0, t_max].
+inline int intersect_children(BVH::WideNode const& node, glm::vec3 const& origin,
+	glm::vec3 const& inv_dir, float t_max, float t_entry[BVH::WideNode::WIDTH])
+{
+#ifdef CG_BVH_SSE
+	__m128 const ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 const ix = _mm_set1_ps(inv_dir.x), iy = _mm_set1_ps(inv_dir.y), iz = _mm_set1_ps(inv_dir.z);
+	__m128 const t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ox), ix);
+	__m128 const t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ox), ix);
+	__m128 const t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), oy), iy);
+	__m128 const t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), oy), iy);
+	__m128 const t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), oz), iz);
+	__m128 const t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), oz), iz);
+	__m128 const t_near = _mm_max_ps(
+		_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+		_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+	__m128 const t_far = _mm_min_ps(
+		_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+		_mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(t_max)));
+	_mm_storeu_ps(t_entry, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int k = 0; k < BVH::WideNode::WIDTH; ++k)
+	{
+		float const t0x = (node.min_x[k] - origin.x) * inv_dir.x, t1x = (node.max_x[k] - origin.x) * inv_dir.x;
+		float const t0y = (node.min_y[k] - origin.y) * inv_dir.y, t1y = (node.max_y[k] - origin.y) * inv_dir.y;
+		float const t0z = (node.min_z[k] - origin.z) * inv_dir.z, t1z = (node.max_z[k] - origin.z) * inv_dir.z;
+		float const t_near = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.f));
+		float const t_far  = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), t_max));
+		t_entry[k] = t_near;
+		mask |= (t_near <= t_far) ? (1 << k) : 0;
+	}
+	return mask;
+#endif
+}
+
+struct StackEntry
+{
+	int   child;
+	int   count;
+	float t;
+};
+
+inline void compare_swap(StackEntry& a, StackEntry& b)
+{
+	if (b.t > a.t)
+	{
+		std::swap(a, b);
+	}
+}
+
+} // namespace
+
+void BVH::
+build_wide_bvh()
+{
+	wide_nodes.clear();
+	if (nodes.empty() || nodes[0].num_triangles <= 0)
+	{
+		return;
+	}
+	wide_nodes.reserve(nodes.size() / 2 + 1);
+	wide_nodes.emplace_back();
+	WideBuild build = { *this };
+	build.collapse(0, 0, 0);
+
+	if ((build.max_depth + 1) * (WideNode::WIDTH - 1) + 1 > wide_stack_size)
+	{
+		std::cerr << "BVH too deep for wide traversal (depth " << build.max_depth
+			<< "), using the binary BVH" << std::endl;
+		wide_nodes.clear();
+	}
+}
+
+/*
+ * Intersect the wide BVH iteratively, returning the nearest intersection
+ * closer than *t_max if there is one.
+ */
+bool BVH::
+intersect_wide(const Ray &ray, float *t_max, Intersection* isect) const
+{
+	cg_assert(t_max);
+	glm::vec3 const inv_dir = 1.f / ray.direction;
+
+	StackEntry stack[wide_stack_size];
+	int sp = 0;
+	stack[sp++] = { 0, 0, 0.f };
+
+	float     nearest = *t_max;
+	int       nearest_triangle = -1;
+	glm::vec3 nearest_bary(0.f);
+	while (sp > 0)
+	{
+		StackEntry const entry = stack[--sp];
+		if (entry.t > nearest)
+		{
+			continue;
+		}
+
+		if (entry.count > 0)
+		{
+			CG_PROFILE_COUNT(TRIANGLE_TESTS, entry.count);
+			LeafTriangle const* const triangles = &leaf_triangles[entry.child];
+			for (int i = 0; i < entry.count; ++i)
+			{
+				float dist;
+				glm::vec3 b;
+				if (intersect_triangle_edges(ray.origin, ray.direction,
+							triangles[i].v0, triangles[i].edge1, triangles[i].edge2,
+							b, dist) && dist <= nearest)
+				{
+					nearest          = dist;
+					nearest_triangle = entry.child + i;
+					nearest_bary     = b;
+				}
+			}
+			continue;
+		}
+
+		WideNode const& node = wide_nodes[entry.child];
+		CG_PROFILE_COUNT(BVH_NODE_VISITS, 1);
+		float t_entry[WideNode::WIDTH];
+		int const mask = intersect_children(node, ray.origin, inv_dir, nearest, t_entry);
+
+		// Sort the children hit by decreasing entry distance, with a
+		// sorting network, and push them so that the nearest is popped
+		// first.
+		StackEntry hit[WideNode::WIDTH];
+		int num_hit = 0;
+		for (int k = 0; k < WideNode::WIDTH; ++k)
+		{
+			bool const used = node.count[k] >= 0 && (mask & (1 << k));
+			hit[k] = { node.child[k], node.count[k], used ? t_entry[k] : -1.f };
+			num_hit += used ? 1 : 0;
+		}
+		compare_swap(hit[0], hit[1]);
+		compare_swap(hit[2], hit[3]);
+		compare_swap(hit[0], hit[2]);
+		compare_swap(hit[1], hit[3]);
+		compare_swap(hit[1], hit[2]);
+		for (int k = 0; k < num_hit; ++k)
+		{
+			stack[sp++] = hit[k];
+		}
+	}
+
+	if (nearest_triangle < 0)
+	{
+		return false;
+	}
+	*t_max = nearest;
+	if (isect)
+	{
+		triangle_soup.fill_intersection(isect, triangle_indices[nearest_triangle], nearest, nearest_bary);
+	}
+	return true;
+}
@@ -6,121 +6,180 @@
 #include <cglib/imgui/imgui.h>
 #include <cglib/rt/bvh.h>
 
-int HostRender::run(RaytracingContext& context, 
-		PixelFunc const& render_pixel, 
-		int kill_timeout_seconds,
-		std::function<void()> const& render_overlay)
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <sstream>
+
+// Color of pixel (x, y) in the given render mode. Mode is a template parameter
+// so that the switch below is resolved at compile time.
+template <int Mode>
+static glm::vec3 shade_pixel(int x, int y, RaytracingContext const& context, 
+		RenderData& data, HostRender::PixelFunc const& render_pixel)
 {
-	auto render_pixel_wrapper = [&](int x, int y, RaytracingContext const &ctx, ThreadLocalData *tld)
-		-> glm::vec3
-		{
-			RenderData data(context, tld);
-			switch(context.params.render_mode) {
+	switch(Mode) {
+		case RaytracingParameters::RECURSIVE:
+			if (context.params.stereo)
+			{
+				data.camera_mode = Camera::StereoLeft;
+				auto const left = render_pixel(x, y, context, data);
+				data.camera_mode = Camera::StereoRight;
+				auto const right = render_pixel(x, y, context, data);
+				return combine_stereo(left, right);
+			}
+			else
+			{
+				return render_pixel(x, y, context, data);
+			}
 
-				case RaytracingParameters::RECURSIVE:
-					if (context.params.stereo)
-					{
-						data.camera_mode = Camera::StereoLeft;
-						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
-						auto const right = render_pixel(x, y, ctx, data);
-						return combine_stereo(left, right);
-					}
-					else
-					{
-						return render_pixel(x, y, ctx, data);
-					}
+		case RaytracingParameters::DESATURATE:
+			if (context.params.stereo)
+			{
+				data.camera_mode = Camera::StereoLeft;
+				auto const left = render_pixel(x, y, context, data);
+				data.camera_mode = Camera::StereoRight;
+				auto const right = render_pixel(x, y, context, data);
+				return combine_stereo(desaturate(left), desaturate(right));
+			}
+			else
+			{
+				// Desaturated on display, see desaturate_on_display().
+				return render_pixel(x, y, context, data);
+			}
 
-				case RaytracingParameters::DESATURATE:
-					if (context.params.stereo)
-					{
-						data.camera_mode = Camera::StereoLeft;
-						auto const left = render_pixel(x, y, ctx, data);
-						data.camera_mode = Camera::StereoRight;
-						auto const right = render_pixel(x, y, ctx, data);
-						return combine_stereo(desaturate(left), desaturate(right));
-					}
-					else
-					{
-						return desaturate(render_pixel(x, y, ctx, data));
+		case RaytracingParameters::NUM_RAYS:
+			render_pixel(x, y, context, data);
+			return heatmap(float(data.num_cast_rays - 1) / 64.0f);
+		case RaytracingParameters::SAMPLE_COUNT:
+			render_pixel(x, y, context, data);
+			return heatmap(float(data.num_samples) 
+				/ float(std::max(context.params.spp, context.params.max_spp)));
+		case RaytracingParameters::NORMAL:
+			render_pixel(x, y, context, data);
+			if (context.params.normal_mapping)
+				return glm::normalize(data.isect.shading_normal) * 0.5f + glm::vec3(0.5f);
+			else
+			{
+				if (data.isect.isValid())
+					return glm::normalize(data.isect.normal) * 0.5f + glm::vec3(0.5f);
+				else
+					return glm::vec3(0.0f);
+			}
+		case RaytracingParameters::BVH_TIME:
+		case RaytracingParameters::TIME: {
+			std::uint64_t const start = Profiler::ticks();
+			if(Mode == RaytracingParameters::TIME) {
+				auto const color = render_pixel(x, y, context, data);
+				(void) color;
+			}
+			else {
+				Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
+				for(auto& o: context.get_active_scene()->objects) {
+					BVH *bvh = dynamic_cast<BVH *>(o.get());
+					if(bvh) {
+						bvh->intersect(ray, nullptr);
 					}
+				}
+			}
+			std::uint64_t const end = Profiler::ticks();
+			return heatmap(static_cast<float>(Profiler::ticks_to_ms(end - start)) * context.params.scale_render_time);
+		}
+		case RaytracingParameters::DUDV: {
+			auto const color = render_pixel(x, y, context, data);
+			(void) color;
+			if(!data.isect.isValid())
+				return glm::vec3(0.0);
+			return heatmap(std::log(1.0f + 5.0f * glm::length(data.isect.dudv)));
+		}
+		case RaytracingParameters::AABB_INTERSECT_COUNT: {
+			Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
+			glm::vec3 accum(0.0f);
+			for(auto& o: context.get_active_scene()->objects) {
+				auto *bvh = dynamic_cast<BVH *>(o.get());
+				if(bvh) {
+					accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
+				}
+			}
+			return accum;
+		}
+		default: /* should never happen */
+		return glm::vec3(1, 0, 1);
+	}
+}
+
+template <int Mode>
+static void shade_tile(HostRender::RenderTile& tile, ThreadLocalData& tld, std::atomic<bool> const& terminate,
+		RaytracingContext const& context, HostRender::PixelFunc const& render_pixel)
+{
+	// The shading flags do not change within a tile.
+	TraceFunc const trace = select_trace_kernel(shading_flags(context.params));
+	for (int y = tile.y0; y < tile.y1; y += tile.scale) 
+	{
+		for (int x = tile.x0; x < tile.x1; x += tile.scale) 
+		{
+			if (terminate.load())
+				return;
 
+			tld.begin_pixel(x, y, tile.pass);
+			RenderData data(context, &tld);
+			data.trace_kernel = trace;
+			data.gbuffer = tile.gbuffer_sample(x, y);
+			data.gbuffer_frame = tile.gbuffer_frame;
+			tile.set_pixel(x, y, shade_pixel<Mode>(x, y, context, data, render_pixel));
+			tile.count_rays(data);
+		}
+	}
+}
+
+// The tile kernel for a per-pixel function. Resolves the render mode once
+// per tile.
+static auto pixel_kernel(RaytracingContext const& context, HostRender::PixelFunc const& render_pixel)
+{
+	return [&context, &render_pixel](HostRender::RenderTile& tile, ThreadLocalData& tld, 
+			std::atomic<bool> const& terminate)
+		{
+			switch(context.params.render_mode) {
+				case RaytracingParameters::RECURSIVE:
+					return shade_tile<RaytracingParameters::RECURSIVE>(tile, tld, terminate, context, render_pixel);
+				case RaytracingParameters::DESATURATE:
+					return shade_tile<RaytracingParameters::DESATURATE>(tile, tld, terminate, context, render_pixel);
 				case RaytracingParameters::NUM_RAYS:
-					render_pixel(x, y, ctx, data);
-					return heatmap(float(data.num_cast_rays - 1) / 64.0f);
+					return shade_tile<RaytracingParameters::NUM_RAYS>(tile, tld, terminate, context, render_pixel);
+				case RaytracingParameters::SAMPLE_COUNT:
+					return shade_tile<RaytracingParameters::SAMPLE_COUNT>(tile, tld, terminate, context, render_pixel);
 				case RaytracingParameters::NORMAL:
-					render_pixel(x, y, ctx, data);
-					if (context.params.normal_mapping)
-						return glm::normalize(data.isect.shading_normal) * 0.5f + glm::vec3(0.5f);
-					else
-					{
-						if (data.isect.isValid())
-							return glm::normalize(data.isect.normal) * 0.5f + glm::vec3(0.5f);
-						else
-							return glm::vec3(0.0f);
-					}
+					return shade_tile<RaytracingParameters::NORMAL>(tile, tld, terminate, context, render_pixel);
 				case RaytracingParameters::BVH_TIME:
-				case RaytracingParameters::TIME: {
- 					Timer timer;
- 					timer.start();
- 					if(context.params.render_mode == RaytracingParameters::TIME) {
- 					    auto const color = render_pixel(x, y, ctx, data);
- 					    (void) color;
- 					}
-					else {
-						Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
-						for(auto& o: context.get_active_scene()->objects) {
-							BVH *bvh = dynamic_cast<BVH *>(o.get());
-							if(bvh) {
-								bvh->intersect(ray, nullptr);
-							}
-						}
-					}
-					timer.stop();
-					return heatmap(static_cast<float>(timer.getElapsedTimeInMilliSec()) * context.params.scale_render_time);
-				}
-				case RaytracingParameters::DUDV: {
-					auto const color = render_pixel(x, y, ctx, data);
-					(void) color;
-					if(!data.isect.isValid())
-						return glm::vec3(0.0);
-					return heatmap(std::log(1.0f + 5.0f * glm::length(data.isect.dudv)));
-				}
-				case RaytracingParameters::AABB_INTERSECT_COUNT: {
-					Ray ray = createPrimaryRay(data, float(x) + 0.5f, float(y) + 0.5f);
-					glm::vec3 accum(0.0f);
-					for(auto& o: context.get_active_scene()->objects) {
-						auto *bvh = dynamic_cast<BVH *>(o.get());
-						if(bvh) {
-							accum += bvh->intersect_count(ray, 0, 0) * 0.02f;
-						}
-					}
-					return accum;
-				}
+					return shade_tile<RaytracingParameters::BVH_TIME>(tile, tld, terminate, context, render_pixel);
+				case RaytracingParameters::TIME:
+					return shade_tile<RaytracingParameters::TIME>(tile, tld, terminate, context, render_pixel);
+				case RaytracingParameters::DUDV:
+					return shade_tile<RaytracingParameters::DUDV>(tile, tld, terminate, context, render_pixel);
+				case RaytracingParameters::AABB_INTERSECT_COUNT:
+					return shade_tile<RaytracingParameters::AABB_INTERSECT_COUNT>(tile, tld, terminate, context, render_pixel);
 				default: /* should never happen */
-				return glm::vec3(1, 0, 1);
+					return shade_tile<RaytracingParameters::RENDER_MODE_COUNT>(tile, tld, terminate, context, render_pixel);
 			}
 		};
+}
 
-	if (context.params.interactive)
-	{
-		return run_interactive(context, render_pixel_wrapper, render_overlay);
-	}
-	else
-	{
-		return run_noninteractive(context, render_pixel_wrapper, 
-				kill_timeout_seconds);
-	}
+int HostRender::run(RaytracingContext& context, 
+		PixelFunc const& render_pixel, 
+		int kill_timeout_seconds,
+		std::function<void()> const& render_overlay)
+{
+	return run_tiles(context, pixel_kernel(context, render_pixel), kill_timeout_seconds, render_overlay);
 }
 
 // -----------------------------------------------------------------------------
 
-void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
+// Tile indices in the order of a spiral that starts in the center of the image.
+// This ensures that we will be able to see updates in the important region of
+// the image quickly.
+static void generate_spiral_idx(int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
 {
-	/* Generate tile indices in the order of a spiral that starts in the center of the image.
-	 * This ensures that we will be able to see updates in the important region of the
-	 * image quickly.
-	 */
 	int const num_tiles = num_tiles_x * num_tiles_y;
 
 	tile_idx->resize(num_tiles);
@@ -152,19 +211,135 @@ void HostRender::generate_tile_idx(int num_tiles_x, int num_tiles_y, std::vector
 	}
 }
 
+// Position of the d-th cell along the Hilbert curve covering an n x n grid,
+// n a power of two.
+static glm::ivec2 hilbert_d2xy(int n, int d)
+{
+	glm::ivec2 p(0);
+	for (int s = 1; s < n; s *= 2)
+	{
+		int const rx = 1 & (d / 2);
+		int const ry = 1 & (d ^ rx);
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				p = glm::ivec2(s - 1) - p;
+			}
+			std::swap(p.x, p.y);
+		}
+		p += glm::ivec2(s * rx, s * ry);
+		d /= 4;
+	}
+	return p;
+}
+
+// Inverse of the Morton code: every other bit of d.
+static int morton_compact(unsigned d)
+{
+	d &= 0x55555555u;
+	d = (d | (d >> 1)) & 0x33333333u;
+	d = (d | (d >> 2)) & 0x0f0f0f0fu;
+	d = (d | (d >> 4)) & 0x00ff00ffu;
+	d = (d | (d >> 8)) & 0x0000ffffu;
+	return static_cast<int>(d);
+}
+
+// Tile indices along a Hilbert or Morton curve over the smallest power of two
+// grid that covers all tiles. Cells outside of the image are skipped.
+static void generate_curve_idx(bool hilbert, int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
+{
+	int n = 1;
+	while (n < num_tiles_x || n < num_tiles_y)
+	{
+		n *= 2;
+	}
+
+	tile_idx->clear();
+	tile_idx->reserve(num_tiles_x * num_tiles_y);
+	for (int d = 0; d < n * n; ++d)
+	{
+		glm::ivec2 const p = hilbert
+			? hilbert_d2xy(n, d)
+			: glm::ivec2(morton_compact(d), morton_compact(d >> 1));
+		if (p.x < num_tiles_x && p.y < num_tiles_y)
+		{
+			tile_idx->push_back(p);
+		}
+	}
+	cg_assert(int(tile_idx->size()) == num_tiles_x * num_tiles_y);
+}
+
+void HostRender::generate_tile_idx(int order, int num_tiles_x, int num_tiles_y, std::vector<glm::ivec2>* tile_idx)
+{
+	switch (order)
+	{
+		case Parameters::TILE_ORDER_HILBERT:
+			generate_curve_idx(true, num_tiles_x, num_tiles_y, tile_idx);
+			break;
+		case Parameters::TILE_ORDER_MORTON:
+			generate_curve_idx(false, num_tiles_x, num_tiles_y, tile_idx);
+			break;
+		default:
+			generate_spiral_idx(num_tiles_x, num_tiles_y, tile_idx);
+			break;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+ThreadAffinity HostRender::thread_affinity(Parameters const& params)
+{
+	// Already validated by Parameters::parse_command_line().
+	ThreadAffinity affinity;
+	affinity.parse(params.thread_affinity);
+	return affinity;
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::build_scenes(Parameters const& params, std::function<void()> const& build)
+{
+	ThreadPool thread_pool(params.num_threads, thread_affinity(params));
+	thread_pool.set_active();
+	build();
+}
+
 // -----------------------------------------------------------------------------
 
 int HostRender::run_noninteractive(RaytracingContext& context, 
-		PixelFuncRaw const& render_pixel, int kill_timeout_seconds)
+		LaunchFunc const& launch, int kill_timeout_seconds)
 {
+	Parameters::Distribution const& distribution = context.params.distribution;
+	if (!distribution.worker_address.empty())
+	{
+		return run_worker(context, launch, distribution.worker_address, true);
+	}
+	if (distribution.local_workers > 0 || distribution.remote_workers > 0)
+	{
+		if (!context.params.sequence_output.empty())
+		{
+			std::cerr << "[HostRender] " << "Sequences cannot be rendered with worker processes" << std::endl;
+			return 1;
+		}
+		return run_coordinator(context, launch, kill_timeout_seconds);
+	}
+	if (!context.params.sequence_output.empty())
+	{
+		return run_sequence(context, launch);
+	}
+
 	Image      frame_buffer(context.params.image_width, context.params.image_height);
-	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	ThreadPool thread_pool(context.params.num_threads, thread_affinity(context.params));
+	thread_pool.set_active();
+	Tiles      tiles;
+	Accumulation accumulation;
+	begin_trace(context.params);
 
 	Timer timer;
 	timer.start();
 	context.get_active_scene()->refresh_scene(context.params);
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	launch(&frame_buffer, thread_pool, &context, &tiles, &accumulation, 0);
 
 	if (kill_timeout_seconds > 0)
 	{
@@ -181,35 +356,75 @@ int HostRender::run_noninteractive(RaytracingContext& context,
 	thread_pool.poll_exceptions();
 	timer.stop();
 	std::cout << "Rendering time: " << timer.getElapsedTimeInMilliSec() << "ms" << std::endl;
+	if (desaturate_on_display(context.params))
+	{
+		frame_buffer.desaturate();
+	}
 	frame_buffer.save(context.params.output_file_name.c_str(), 2.2f);
+	end_trace(context.params);
 
 	return 0;
 }
 
 // -----------------------------------------------------------------------------
 
-int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const& render_pixel,
+int HostRender::run_interactive(RaytracingContext& context, LaunchFunc const& launch,
 		std::function<void()> const& render_overlay)
 {
 	Image      frame_buffer(context.params.image_width, context.params.image_height);
-	ThreadPool thread_pool(context.params.num_threads);
-	std::vector<glm::ivec2> tile_idx;
+	ThreadPool thread_pool(context.params.num_threads, thread_affinity(context.params));
+	thread_pool.set_active();
+	Tiles      tiles;
+	Accumulation accumulation;
 
 	if (!GUI::init_host(context.params))
 	{
 		return 1;
 	}
+	begin_trace(context.params);
 
 	if(context.get_active_scene())
 		context.get_active_scene()->set_active_camera();
 
+	// Shading time per pixel, measured on previous launches. Drives the
+	// pixel scale of previews.
+	float us_per_pixel  = 0.f;
+	bool  measured      = false;
+	auto  time_launched = std::chrono::high_resolution_clock::now();
+	auto start = [&](int pass)
+		{
+			launch(&frame_buffer, thread_pool, &context, &tiles, &accumulation, pass);
+			time_launched = std::chrono::high_resolution_clock::now();
+			measured = false;
+		};
+	auto measure = [&]()
+		{
+			int const num_jobs = thread_pool.num_jobs();
+			int const done     = std::min(thread_pool.jobs_done(), num_jobs);
+			if (measured || num_jobs == 0)
+				return;
+			float const elapsed_us = float(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::high_resolution_clock::now() - time_launched).count());
+			float const pixels = float(std::max(done, 1)) / float(num_jobs)
+				* float(frame_buffer.getWidth()) * float(frame_buffer.getHeight())
+				/ float(accumulation.scale * accumulation.scale);
+			float const cost = elapsed_us / pixels;
+			if (done == 0)
+				// Not even one tile is complete: cost is a lower bound.
+				us_per_pixel = std::max(us_per_pixel, cost);
+			else
+				us_per_pixel = us_per_pixel > 0.f ? 0.5f * (us_per_pixel + cost) : cost;
+			measured = done == num_jobs;
+		};
+
 	// Launch first render.
-	launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+	start(0);
 
 	auto time_last_frame = std::chrono::high_resolution_clock::now();
 
 	RaytracingParameters oldParams = context.params;
 	int update_flags = false;
+	std::vector<glm::ivec4> dirty_tiles;
 	while (GUI::keep_running())
 	{
 		GUI::poll_events();
@@ -217,9 +432,19 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 
 		// Restart rendering if parameters have changed.
 		auto cam = Camera::get_active();
-		if (cam && cam->requires_restart())
+		bool const camera_moved = cam && cam->requires_restart();
+		if (camera_moved)
 			update_flags |= GUI::FLAG_REDRAW;
 
+		// Post-processing is applied on display and needs no new frame.
+		update_flags &= ~GUI::FLAG_POSTPROCESS;
+
+		bool const complete = thread_pool.jobs_done() >= thread_pool.num_jobs();
+		if (complete || update_flags)
+		{
+			measure();
+		}
+
 		if(update_flags) {
 			thread_pool.terminate();
 		}
@@ -242,25 +467,34 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 					context.get_active_scene()->refresh_scene(context.params);
 				}
 			}
-			if(context.params.spp < oldParams.spp)
-			{
-				while(int(sqrtf(static_cast<float>(context.params.spp))) * int(sqrtf(static_cast<float>(context.params.spp))) != context.params.spp
-						&& context.params.spp >= 1)
-				{
-					context.params.spp--;
-				}
-			}
-			else
+			else if (oldParams.bvh_traversal != context.params.bvh_traversal
+				&& context.get_active_scene())
 			{
-				while(int(sqrtf(static_cast<float>(context.params.spp))) * int(sqrtf(static_cast<float>(context.params.spp))) != context.params.spp)
-				{
-					context.params.spp++;
-				}
+				// Same builder, so this only switches the traversal.
+				context.get_active_scene()->rebuild_bvhs(context.params);
 			}
+			context.params.spp = std::max(1, context.params.spp);
 			oldParams = context.params;
-			launch(&frame_buffer, thread_pool, &context, &tile_idx, render_pixel);
+			// Preview at reduced resolution while the camera moves.
+			accumulation.scale = camera_moved ? choose_pixel_scale(context.params, us_per_pixel) : 1;
+			// Only shading switches changed: shade the primary hits again.
+			accumulation.reshade = update_flags == GUI::FLAG_RESHADE;
+			start(0);
 			update_flags = 0;
 		}
+		else if (accumulation.scale > 1 && complete)
+		{
+			// The camera stopped, render at full resolution.
+			accumulation.scale = 1;
+			start(0);
+		}
+		else if (can_accumulate(context.params)
+			&& accumulation.pass + 1 < context.params.max_passes
+			&& complete)
+		{
+			// Nothing changed and the last pass is complete, refine.
+			start(accumulation.pass + 1);
+		}
 
 		// Update the texture displayed online in regular intervals so that
 		// we don't waste many cycles uploading all the time.
@@ -268,22 +502,455 @@ int HostRender::run_interactive(RaytracingContext& context, PixelFuncRaw const&
 		float const mspf = 1000.f / static_cast<float>(context.params.fps);
 		if (std::chrono::duration_cast<std::chrono::milliseconds>(now-time_last_frame).count() > mspf)
 		{
-			update_flags = GUI::display_host(frame_buffer, render_overlay);
+			context.params.desaturate = desaturate_on_display(context.params);
+			// Upload only the tiles completed since the last display. Tiles
+			// still being rendered are not read, the display keeps showing
+			// the previous frame there. If the whole texture is stale, all
+			// completed tiles are uploaded again.
+			if (GUI::needs_full_upload())
+			{
+				tiles.displayed.assign(tiles.displayed.size(), 0);
+			}
+			collect_dirty_tiles(frame_buffer.getWidth(), frame_buffer.getHeight(), &tiles, &dirty_tiles);
+			update_flags = GUI::display_host(frame_buffer, render_overlay, &dirty_tiles);
 		}
 	}
 
 	GUI::cleanup();
+	thread_pool.terminate();
+	end_trace(context.params);
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Camera poses of a benchmark camera path, one "px py pz dx dy dz" per line.
+// Empty lines and lines starting with '#' are skipped.
+static bool load_camera_path(std::string const& file_name, std::vector<std::pair<glm::vec3, glm::vec3>>* poses)
+{
+	std::ifstream file(file_name);
+	if (!file)
+	{
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+		std::istringstream is(line);
+		glm::vec3 position, direction;
+		if (!(is >> position.x >> position.y >> position.z >> direction.x >> direction.y >> direction.z))
+		{
+			return false;
+		}
+		poses->emplace_back(position, glm::normalize(direction));
+	}
+	return !poses->empty();
+}
+
+int HostRender::run_benchmark(RaytracingContext& context, 
+		PixelFunc const& render_pixel, 
+		SceneFactory const& create_scene)
+{
+	RaytracingParameters& params = context.params;
+	ThreadPool thread_pool(params.num_threads, thread_affinity(params));
+	thread_pool.set_active();
+
+	// Loading includes building the BVHs, which is also reported on its own.
+	Timer load_timer;
+	load_timer.start();
+	begin_trace(params);
+	std::shared_ptr<Scene> scene = create_scene(params.benchmark_scene);
+	if (!scene)
+	{
+		std::cerr << "[HostRender] " << "Unknown benchmark scene '" << params.benchmark_scene << "'" << std::endl;
+		return 1;
+	}
+	context.add_scene(scene);
+	params.active_scene = static_cast<int>(context.get_scenes().size()) - 1;
+	scene->refresh_scene(params);
+	load_timer.stop();
+
+	double bvh_build_ms = 0.0;
+	for (auto& o : scene->objects)
+	{
+		if (BVH const* bvh = dynamic_cast<BVH const*>(o.get()))
+		{
+			bvh_build_ms += bvh->build_time_ms;
+		}
+	}
+
+	std::vector<std::pair<glm::vec3, glm::vec3>> camera_path;
+	if (!params.benchmark_camera_path.empty() 
+		&& !load_camera_path(params.benchmark_camera_path, &camera_path))
+	{
+		std::cerr << "[HostRender] " << "Cannot read camera path '" << params.benchmark_camera_path << "'" << std::endl;
+		return 1;
+	}
+
+	Image        frame_buffer(params.image_width, params.image_height);
+	Tiles        tiles;
+	Accumulation accumulation;
+	auto const   kernel = pixel_kernel(context, render_pixel);
+
+	// Statistics of the timed frames.
+	std::vector<double>             frame_ms;
+	std::vector<Tiles::WorkerStats> workers(thread_pool.num_threads());
+
+	int const num_frames = params.benchmark_warmup + params.benchmark_repeat;
+	for (int frame = 0; frame < num_frames; ++frame)
+	{
+		if (!camera_path.empty())
+		{
+			auto const& pose = camera_path[frame % camera_path.size()];
+			scene->camera->set_position(pose.first);
+			scene->camera->set_direction(pose.second);
+		}
+
+		tiles.workers.assign(thread_pool.num_threads(), Tiles::WorkerStats());
+
+		Timer timer;
+		timer.start();
+		launch(&frame_buffer, thread_pool, &context, &tiles, &accumulation, 0, kernel);
+		thread_pool.wait();
+		thread_pool.poll_exceptions();
+		timer.stop();
+
+		if (frame < params.benchmark_warmup)
+		{
+			continue;
+		}
+
+		frame_ms.push_back(timer.getElapsedTimeInMilliSec());
+		for (std::size_t w = 0; w < workers.size(); ++w)
+		{
+			workers[w].busy_us += tiles.workers[w].busy_us;
+			workers[w].tiles   += tiles.workers[w].tiles;
+			for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+			{
+				workers[w].num_rays[i] += tiles.workers[w].num_rays[i];
+			}
+		}
+	}
+
+	end_trace(params);
+
+	// Report.
+	static char const* const ray_type_names[RenderData::RAY_TYPE_COUNT] = {
+		"primary", "shadow", "secondary"
+	};
+
+	double const total_ms = std::accumulate(frame_ms.begin(), frame_ms.end(), 0.0);
+	std::vector<double> sorted_ms = frame_ms;
+	std::sort(sorted_ms.begin(), sorted_ms.end());
+
+	std::uint64_t num_rays[RenderData::RAY_TYPE_COUNT] = {};
+	std::uint64_t total_rays = 0;
+	for (auto const& w : workers)
+	{
+		for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+		{
+			num_rays[i] += w.num_rays[i];
+			total_rays  += w.num_rays[i];
+		}
+	}
+	// Rays per microsecond are millions of rays per second.
+	auto const mrays_per_s = [&](std::uint64_t rays) { return double(rays) / (total_ms * 1000.0); };
+
+	std::ostringstream json;
+	json << "{\n"
+		<< "  \"scene\": \"" << params.benchmark_scene << "\",\n"
+		<< "  \"width\": " << params.image_width << ",\n"
+		<< "  \"height\": " << params.image_height << ",\n"
+		<< "  \"spp\": " << params.spp << ",\n"
+		<< "  \"threads\": " << thread_pool.num_threads() << ",\n"
+		<< "  \"tile_size\": " << tiles.size << ",\n"
+		<< "  \"warmup\": " << params.benchmark_warmup << ",\n"
+		<< "  \"repeat\": " << params.benchmark_repeat << ",\n"
+		<< "  \"camera_path_poses\": " << camera_path.size() << ",\n"
+		<< "  \"scene_load_ms\": " << load_timer.getElapsedTimeInMilliSec() << ",\n"
+		<< "  \"bvh_build_ms\": " << bvh_build_ms << ",\n"
+		<< "  \"frame_ms\": [";
+	for (std::size_t i = 0; i < frame_ms.size(); ++i)
+	{
+		json << (i ? ", " : "") << frame_ms[i];
+	}
+	json << "],\n"
+		<< "  \"wall_ms\": { "
+		<< "\"total\": " << total_ms << ", "
+		<< "\"mean\": " << total_ms / double(frame_ms.size()) << ", "
+		<< "\"median\": " << sorted_ms[sorted_ms.size() / 2] << ", "
+		<< "\"min\": " << sorted_ms.front() << ", "
+		<< "\"max\": " << sorted_ms.back() << " },\n"
+		<< "  \"rays_per_frame\": { ";
+	for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+	{
+		json << "\"" << ray_type_names[i] << "\": " << num_rays[i] / frame_ms.size() << ", ";
+	}
+	json << "\"total\": " << total_rays / frame_ms.size() << " },\n"
+		<< "  \"mrays_per_s\": { ";
+	for (int i = 0; i < RenderData::RAY_TYPE_COUNT; ++i)
+	{
+		json << "\"" << ray_type_names[i] << "\": " << mrays_per_s(num_rays[i]) << ", ";
+	}
+	json << "\"total\": " << mrays_per_s(total_rays) << " },\n"
+		<< "  \"thread_utilization\": [";
+	for (std::size_t w = 0; w < workers.size(); ++w)
+	{
+		json << (w ? ", " : "") << double(workers[w].busy_us) / (total_ms * 1000.0);
+	}
+	json << "],\n"
+		<< "  \"thread_tiles\": [";
+	for (std::size_t w = 0; w < workers.size(); ++w)
+	{
+		json << (w ? ", " : "") << workers[w].tiles;
+	}
+	json << "]\n"
+		<< "}\n";
+
+	if (params.benchmark_output.empty())
+	{
+		std::cout << json.str() << std::flush;
+	}
+	else
+	{
+		std::ofstream file(params.benchmark_output);
+		if (!(file << json.str()))
+		{
+			std::cerr << "[HostRender] " << "Cannot write benchmark report '" << params.benchmark_output << "'" << std::endl;
+			return 1;
+		}
+	}
 
 	return 0;
 }
 
 // -----------------------------------------------------------------------------
 
-void HostRender::launch(Image* fb, 
+// The first run of '#' in pattern replaced by the zero padded frame number.
+static std::string sequence_file_name(std::string const& pattern, int frame)
+{
+	std::size_t const begin = pattern.find('#');
+	if (begin == std::string::npos)
+	{
+		return pattern;
+	}
+	std::size_t const end = std::min(pattern.find_first_not_of('#', begin), pattern.size());
+	std::string number = std::to_string(frame);
+	if (number.size() < end - begin)
+	{
+		number.insert(0, end - begin - number.size(), '0');
+	}
+	return pattern.substr(0, begin) + number + pattern.substr(end);
+}
+
+int HostRender::run_sequence(RaytracingContext& context, 
+		LaunchFunc const& launch)
+{
+	RaytracingParameters const& params = context.params;
+	Scene* const scene = context.get_active_scene();
+
+	std::vector<std::pair<glm::vec3, glm::vec3>> camera_path;
+	if (!load_camera_path(params.benchmark_camera_path, &camera_path))
+	{
+		std::cerr << "[HostRender] " << "Sequences need a camera path, cannot read '" 
+			<< params.benchmark_camera_path << "'" << std::endl;
+		return 1;
+	}
+	if (params.sequence_output.find('#') == std::string::npos && camera_path.size() > 1)
+	{
+		std::cerr << "[HostRender] " << "Sequence output '" << params.sequence_output
+			<< "' has no '#' for the frame number" << std::endl;
+		return 1;
+	}
+
+	// Post-processing and encoding run on their own threads, so that they
+	// never delay tiles.
+	ThreadPool thread_pool(params.num_threads, thread_affinity(params));
+	thread_pool.set_active();
+	ThreadPool io_pool(params.sequence_io_threads);
+	Tiles        tiles;
+	Accumulation accumulation;
+	begin_trace(params);
+
+	Timer timer;
+	timer.start();
+	scene->refresh_scene(params);
+
+	// Frames waiting to be written, oldest first. Each owns its image, so
+	// the queue bounds the memory.
+	std::deque<std::future<void>> writes;
+	bool const desaturate = desaturate_on_display(params);
+	double render_ms = 0.0;
+	double stall_ms  = 0.0;
+	for (int frame = 0; frame < int(camera_path.size()); ++frame)
+	{
+		scene->camera->set_position(camera_path[frame].first);
+		scene->camera->set_direction(camera_path[frame].second);
+
+		Timer frame_timer;
+		frame_timer.start();
+		auto frame_buffer = std::make_shared<Image>(params.image_width, params.image_height);
+		launch(frame_buffer.get(), thread_pool, &context, &tiles, &accumulation, 0);
+		thread_pool.wait();
+		thread_pool.poll_exceptions();
+		frame_timer.stop();
+		render_ms += frame_timer.getElapsedTimeInMilliSec();
+
+		Timer stall_timer;
+		stall_timer.start();
+		while (int(writes.size()) >= params.sequence_queue)
+		{
+			writes.front().get();
+			writes.pop_front();
+		}
+		stall_timer.stop();
+		stall_ms += stall_timer.getElapsedTimeInMilliSec();
+
+		std::string const file_name = sequence_file_name(params.sequence_output, frame);
+		writes.push_back(io_pool.submit(ThreadPool::PRIORITY_NORMAL, [&io_pool, frame_buffer, file_name, desaturate]()
+			{
+				if (desaturate)
+				{
+					frame_buffer->desaturate(io_pool);
+				}
+				frame_buffer->save(file_name, 2.2f);
+			}));
+	}
+	for (auto& write : writes)
+	{
+		write.get();
+	}
+	timer.stop();
+	end_trace(params);
+
+	std::cout << "Rendered " << camera_path.size() << " frames in " << timer.getElapsedTimeInMilliSec() << "ms ("
+		<< render_ms << "ms rendering, " << stall_ms << "ms waiting for output)" << std::endl;
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::choose_tile_size(RaytracingParameters const& params, 
+		int width, int height, int num_threads, Tiles* tiles)
+{
+	if (params.tile_size > 0)
+	{
+		return params.tile_size;
+	}
+
+	// Aim for at least 8 tiles per thread so that the load stays balanced
+	// towards the end of a frame.
+	int const max_size = std::max(4, static_cast<int>(
+		std::sqrt(float(width) * float(height) / float(8 * std::max(1, num_threads)))));
+	auto round_to_pow2 = [](float size)
+		{
+			return 1 << std::max(0, static_cast<int>(std::round(std::log2(std::max(1.f, size)))));
+		};
+
+	if (tiles->auto_size == 0)
+	{
+		tiles->auto_size = std::min(32, round_to_pow2(float(max_size)));
+		tiles->tuned = false;
+		return tiles->auto_size;
+	}
+
+	// Tune once the first frame is complete: grow tiles that are so cheap
+	// that scheduling overhead and cold caches dominate (target ~1ms per
+	// tile), without giving up load balance.
+	bool complete = !tiles->tuned && tiles->count() > 0;
+	for (int i = 0; complete && i < tiles->count(); ++i)
+	{
+		complete = tiles->is_done(i);
+	}
+	if (complete)
+	{
+		float const target_us = 1000.f;
+		float const tile_us = std::max(1.f, float(tiles->busy_us.load()) / float(tiles->count()));
+		float const size = float(tiles->auto_size) * std::sqrt(target_us / tile_us);
+		tiles->auto_size = glm::clamp(round_to_pow2(std::min(size, float(max_size))), 4, 128);
+		tiles->tuned = true;
+		std::cout << "[HostRender] " << "Tile size tuned to " << tiles->auto_size
+			<< " (" << tile_us << "us per tile)" << std::endl;
+	}
+	return tiles->auto_size;
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::choose_pixel_scale(RaytracingParameters const& params, float us_per_pixel)
+{
+	if (!params.dynamic_resolution || us_per_pixel <= 0.f)
+	{
+		return 1;
+	}
+
+	// Shade as many pixels as fit into one frame at the display rate.
+	float const frame_us = 1e6f / static_cast<float>(std::max<std::uint32_t>(1, params.fps));
+	float const pixels   = float(params.image_width) * float(params.image_height);
+	int const   scale    = static_cast<int>(std::ceil(std::sqrt(pixels * us_per_pixel / frame_us)));
+	return glm::clamp(scale, 1, std::max(1, params.max_pixel_scale));
+}
+
+// -----------------------------------------------------------------------------
+
+bool HostRender::can_accumulate(RaytracingParameters const& params)
+{
+	// The debug visualizations are deterministic, more passes do not help.
+	return params.progressive
+		&& (params.render_mode == RaytracingParameters::RECURSIVE
+		 || params.render_mode == RaytracingParameters::DESATURATE);
+}
+
+bool HostRender::desaturate_on_display(RaytracingParameters const& params)
+{
+	// Stereo images are desaturated per eye before they are combined.
+	return params.render_mode == RaytracingParameters::DESATURATE && !params.stereo;
+}
+
+bool HostRender::can_use_gbuffer(RaytracingParameters const& params)
+{
+	// Exactly one primary ray per pixel, through its center in pass 0.
+	return params.gbuffer_cache
+		&& params.interactive
+		&& params.spp == 1
+		&& !params.adaptive_sampling
+		&& !params.stereo
+		&& (params.render_mode == RaytracingParameters::RECURSIVE
+		 || params.render_mode == RaytracingParameters::DESATURATE);
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::begin_trace(Parameters const& params)
+{
+	Profiler::clear_trace();
+	Profiler::set_tracing(!params.trace_file.empty());
+}
+
+void HostRender::end_trace(Parameters const& params)
+{
+	Profiler::set_tracing(false);
+	if (!params.trace_file.empty() && !Profiler::write_chrome_trace(params.trace_file))
+	{
+		std::cerr << "[HostRender] " << "Cannot write trace '" << params.trace_file << "'" << std::endl;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+void HostRender::prepare_launch(Image* fb, 
 		ThreadPool& thread_pool, 
 		RaytracingContext const* context, 
-		std::vector<glm::ivec2>* tile_idx,
-		PixelFuncRaw render_pixel)
+		Tiles* tiles,
+		Accumulation* accumulation,
+		int pass)
 {
 	if (!thread_pool.enough_progress())
 	{
@@ -292,53 +959,86 @@ void HostRender::launch(Image* fb,
 
 	// Clean up.
 	thread_pool.terminate();
-	fb->clear(glm::vec4(0.f));
 
-	// Compute number of tiles (work units).
 	int const width  = fb->getWidth();
 	int const height = fb->getHeight();
-	int const tile_size   = context->params.tile_size;
-	int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
-	int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
-	int const num_tiles   = num_tiles_x * num_tiles_y;
 
-	// New tile indices.
-	generate_tile_idx(num_tiles_x, num_tiles_y, tile_idx);
-
-	// Launch threads.
-	thread_pool.run<ThreadLocalData>(num_tiles, 
-			// The actual kernel.
-			[=](int tile, ThreadLocalData* tld, std::atomic<bool>& terminate)
-			{
-				glm::ivec2 const idx = (*tile_idx)[tile];
-				int const baseX = std::max<int>(idx[0] * tile_size, 0);
-				int const endX  = std::min<int>(baseX + tile_size, width);
+	// The first pass starts from scratch, later passes refine the image.
+	// Batches add tiles to the image rendered so far.
+	bool const batch = !tiles->batch.empty();
+	accumulation->pass = pass;
+	if (pass == 0 && (!batch || int(accumulation->count.size()) != width * height))
+	{
+		Profiler::reset();
+		fb->clear(glm::vec4(0.f));
+		accumulation->sum.assign(width * height, glm::vec3(0.f));
+		accumulation->count.assign(width * height, 0);
 
-				int const baseY = std::max<int>(idx[1] * tile_size, 0);
-				int const endY  = std::min<int>(baseY + tile_size, height);
+		if (!accumulation->reshade)
+		{
+			accumulation->gbuffer_frame++;
+		}
+		accumulation->reshade = false;
+	}
 
-				Image img(endX-baseX, endY-baseY);
-				for (int y = baseY; y < endY; y++) 
-				{
-					for (int x = baseX; x < endX; x++) 
-					{
-						if (terminate.load())
-							return;
+	// Later passes jitter the primary rays, previews shade one pixel per block.
+	accumulation->gbuffer_active = pass == 0 && accumulation->scale == 1 && can_use_gbuffer(context->params);
+	if (accumulation->gbuffer_active)
+	{
+		accumulation->gbuffer.resize(width * height);
+	}
+	else if (!context->params.gbuffer_cache)
+	{
+		std::vector<GBufferSample>().swap(accumulation->gbuffer);
+	}
 
-						glm::vec3 const color = render_pixel(x, y, *context, dynamic_cast<ThreadLocalData*>(tld));
-						img.setPixel(x-baseX, y-baseY, glm::vec4(color, 1.f));
-					}
-				}
+	// Compute number of tiles (work units).
+	int const tile_size   = choose_tile_size(context->params, width, height, thread_pool.num_threads(), tiles);
+	int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
+	int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
 
-				std::lock_guard<std::mutex> lock(mutex);
-				for (int y = baseY; y < endY; y++) 
-				{
-					for (int x = baseX; x < endX; x++) 
-					{
-						fb->setPixel(x, y, img.getPixel(x-baseX, y-baseY));
-					}
-				}
+	// New tile indices. No worker touches the tiles anymore.
+	int const old_num_tiles = tiles->count();
+	if (batch)
+	{
+		tiles->idx = tiles->batch;
+	}
+	else
+	{
+		generate_tile_idx(context->params.tile_order, num_tiles_x, num_tiles_y, &tiles->idx);
+	}
+	int const num_tiles = tiles->count();
+	if (num_tiles != old_num_tiles)
+	{
+		tiles->done.reset(new std::atomic<bool>[num_tiles]);
+	}
+	tiles->size = tile_size;
+	tiles->workers.resize(thread_pool.num_threads());
+	if (!tiles->tuned)
+	{
+		tiles->busy_us.store(0);
+	}
+	for (int i = 0; i < num_tiles; ++i)
+	{
+		tiles->done[i].store(false, std::memory_order_relaxed);
+	}
+	tiles->displayed.assign(num_tiles, 0);
+}
 
-			}
-	);
+void HostRender::collect_dirty_tiles(int width, int height, Tiles* tiles, std::vector<glm::ivec4>* dirty)
+{
+	dirty->clear();
+	for (int i = 0; i < tiles->count(); ++i)
+	{
+		// The acquire in is_done() makes the pixels of the tile visible.
+		if (tiles->displayed[i] || !tiles->is_done(i))
+		{
+			continue;
+		}
+		tiles->displayed[i] = 1;
+		glm::ivec2 const idx = tiles->idx[i];
+		int const x0 = std::max(idx.x * tiles->size, 0);
+		int const y0 = std::max(idx.y * tiles->size, 0);
+		dirty->emplace_back(x0, y0, std::min(x0 + tiles->size, width), std::min(y0 + tiles->size, height));
+	}
 }
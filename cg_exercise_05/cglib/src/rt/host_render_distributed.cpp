@@ -0,0 +1,474 @@
+#include <cglib/rt/host_render.h>
+#include <cglib/core/socket.h>
+
+#include <deque>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define CG_HAVE_PROCESSES 1
+#  include <csignal>
+#  include <cerrno>
+#  include <poll.h>
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+/*
+ * Distributed rendering protocol. The worker connects and sends HELLO, the
+ * coordinator answers with BATCH messages, each answered by one TILES
+ * message in order, and finally sends DONE.
+ *
+ * HELLO: width, height, number of threads, scene name (length, chars)
+ * BATCH: tile size, number of tiles, tile indices (ivec2)
+ * TILES: number of tiles, per tile x0, y0, x1, y1 and the RGBA pixels
+ *        of its rows
+ * DONE:  nothing
+ */
+enum MessageType : std::uint32_t
+{
+	MSG_HELLO,
+	MSG_BATCH,
+	MSG_TILES,
+	MSG_DONE
+};
+
+// Remote workers may still be loading the scene.
+static int const connect_timeout_seconds = 300;
+
+// Batches in flight per worker, so that a worker does not idle while its
+// results travel to the coordinator and the next batch back.
+static int const batches_in_flight = 2;
+
+static std::string scene_name(RaytracingContext const& context)
+{
+	Scene* scene = context.get_active_scene();
+	return scene ? scene->get_name() : "";
+}
+
+// -----------------------------------------------------------------------------
+
+int HostRender::run_worker(RaytracingContext& context,
+		LaunchFunc const& launch,
+		std::string const& address,
+		bool load_scene)
+{
+	MessageSocket socket = MessageSocket::connect(address, connect_timeout_seconds);
+	if (!socket.is_open())
+	{
+		return 1;
+	}
+
+	ThreadPool thread_pool(context.params.num_threads, thread_affinity(context.params));
+	thread_pool.set_active();
+	if (load_scene)
+	{
+		context.get_active_scene()->refresh_scene(context.params);
+	}
+
+	{
+		std::string const name = scene_name(context);
+		MessageWriter hello;
+		hello.put(MSG_HELLO);
+		hello.put(context.params.image_width);
+		hello.put(context.params.image_height);
+		hello.put(thread_pool.num_threads());
+		hello.put(static_cast<std::uint32_t>(name.size()));
+		hello.put(name.data(), name.size());
+		if (!socket.send(hello.data()))
+		{
+			std::cerr << "[HostRender] " << "Lost connection to coordinator " << address << std::endl;
+			return 1;
+		}
+	}
+
+	Image        frame_buffer(context.params.image_width, context.params.image_height);
+	Tiles        tiles;
+	Accumulation accumulation;
+	std::vector<char> message;
+	for (;;)
+	{
+		if (!socket.receive(&message))
+		{
+			std::cerr << "[HostRender] " << "Lost connection to coordinator " << address << std::endl;
+			return 1;
+		}
+
+		MessageReader reader(message);
+		MessageType type;
+		std::uint32_t tile_size = 0;
+		std::uint32_t num_tiles = 0;
+		if (!reader.get(&type) || type == MSG_DONE)
+		{
+			break;
+		}
+		if (type != MSG_BATCH
+			|| !reader.get(&tile_size) || tile_size == 0
+			|| !reader.get(&num_tiles) || num_tiles == 0)
+		{
+			std::cerr << "[HostRender] " << "Invalid message from coordinator" << std::endl;
+			return 1;
+		}
+		tiles.batch.resize(num_tiles);
+		if (!reader.get(tiles.batch.data(), num_tiles))
+		{
+			std::cerr << "[HostRender] " << "Invalid message from coordinator" << std::endl;
+			return 1;
+		}
+
+		context.params.tile_size = tile_size;
+		launch(&frame_buffer, thread_pool, &context, &tiles, &accumulation, 0);
+		thread_pool.wait();
+		thread_pool.poll_exceptions();
+
+		int const width  = frame_buffer.getWidth();
+		int const height = frame_buffer.getHeight();
+		MessageWriter result;
+		result.put(MSG_TILES);
+		result.put(num_tiles);
+		for (glm::ivec2 const& idx : tiles.batch)
+		{
+			int const x0 = std::max<int>(idx.x * int(tile_size), 0);
+			int const y0 = std::max<int>(idx.y * int(tile_size), 0);
+			int const x1 = std::min<int>(x0 + int(tile_size), width);
+			int const y1 = std::min<int>(y0 + int(tile_size), height);
+			result.put(x0);
+			result.put(y0);
+			result.put(x1);
+			result.put(y1);
+			for (int y = y0; y < y1; ++y)
+			{
+				result.put(frame_buffer.getPixels() + y * width + x0, std::size_t(std::max(0, x1 - x0)));
+			}
+		}
+		if (!socket.send(result.data()))
+		{
+			std::cerr << "[HostRender] " << "Lost connection to coordinator " << address << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef CG_HAVE_PROCESSES
+
+namespace {
+
+struct RemoteWorker
+{
+	MessageSocket                       socket;
+	int                                 num_threads = 1;
+	// Batches sent, in the order the results arrive.
+	std::deque<std::vector<glm::ivec2>> in_flight;
+};
+
+}
+
+// Copies the tiles of a TILES message into the frame buffer. Returns the
+// number of tiles, or -1 if the message is invalid.
+static int receive_tiles(std::vector<char> const& message, Image* frame_buffer)
+{
+	MessageReader reader(message);
+	MessageType type;
+	std::uint32_t num_tiles = 0;
+	if (!reader.get(&type) || type != MSG_TILES || !reader.get(&num_tiles))
+	{
+		return -1;
+	}
+
+	int const width  = frame_buffer->getWidth();
+	int const height = frame_buffer->getHeight();
+	for (std::uint32_t i = 0; i < num_tiles; ++i)
+	{
+		int x0, y0, x1, y1;
+		if (!reader.get(&x0) || !reader.get(&y0) || !reader.get(&x1) || !reader.get(&y1)
+			|| x0 < 0 || y0 < 0 || x1 > width || y1 > height || x0 > x1 || y0 > y1)
+		{
+			return -1;
+		}
+		for (int y = y0; y < y1; ++y)
+		{
+			if (!reader.get(frame_buffer->getPixels() + y * width + x0, std::size_t(x1 - x0)))
+			{
+				return -1;
+			}
+		}
+	}
+	return reader.at_end() ? static_cast<int>(num_tiles) : -1;
+}
+
+int HostRender::run_coordinator(RaytracingContext& context,
+		LaunchFunc const& launch,
+		int kill_timeout_seconds)
+{
+	RaytracingParameters& params = context.params;
+	Parameters::Distribution const& distribution = params.distribution;
+
+	std::string address = distribution.listen_address;
+	if (address.empty())
+	{
+		if (distribution.remote_workers > 0)
+		{
+			std::cerr << "[HostRender] " << "Remote workers need a --listen address" << std::endl;
+			return 1;
+		}
+		address = "unix:/tmp/cg_render_" + std::to_string(getpid()) + ".sock";
+	}
+	ListenSocket listener;
+	if (!listener.listen(address))
+	{
+		return 1;
+	}
+
+	Timer timer;
+	timer.start();
+	build_scenes(params, [&]() { context.get_active_scene()->refresh_scene(params); });
+
+	// Local workers inherit the loaded scene. Fork before this process starts
+	// render threads, and share the cores among the workers.
+	std::vector<pid_t> children;
+	for (int i = 0; i < distribution.local_workers; ++i)
+	{
+		pid_t const pid = fork();
+		if (pid == 0)
+		{
+			params.num_threads = std::max(1, params.num_threads / distribution.local_workers);
+			int const result = run_worker(context, launch, address, false);
+			std::cout << std::flush;
+			std::cerr << std::flush;
+			// Skip the destructors of the parent's state, in particular the
+			// listener, which would remove the socket file.
+			_exit(result);
+		}
+		if (pid < 0)
+		{
+			std::cerr << "[HostRender] " << "Cannot start worker process " << i << std::endl;
+			break;
+		}
+		children.push_back(pid);
+	}
+
+	int const expected_workers = static_cast<int>(children.size()) + distribution.remote_workers;
+	std::cout << "[HostRender] " << "Distributing tiles to " << expected_workers
+		<< " workers on " << address << std::endl;
+
+	// The scene and image size must match on all workers.
+	int const width  = params.image_width;
+	int const height = params.image_height;
+	std::string const name = scene_name(context);
+	std::vector<RemoteWorker> workers;
+	workers.reserve(expected_workers);
+	auto const accept_worker = [&](int timeout_ms)
+		{
+			MessageSocket socket = listener.accept(timeout_ms);
+			std::vector<char> message;
+			if (!socket.is_open() || !socket.receive(&message))
+			{
+				return;
+			}
+			MessageReader reader(message);
+			MessageType type;
+			int w = 0, h = 0, threads = 0;
+			std::uint32_t name_size = 0;
+			std::string worker_scene;
+			bool valid = reader.get(&type) && type == MSG_HELLO
+				&& reader.get(&w) && reader.get(&h) && reader.get(&threads)
+				&& reader.get(&name_size) && name_size <= message.size();
+			if (valid)
+			{
+				worker_scene.resize(name_size);
+				valid = reader.get(&worker_scene[0], name_size) && reader.at_end();
+			}
+			if (!valid || w != width || h != height || worker_scene != name)
+			{
+				std::cerr << "[HostRender] " << "Rejected worker: it renders scene '" << worker_scene
+					<< "' at " << w << "x" << h << std::endl;
+				return;
+			}
+			RemoteWorker worker;
+			worker.socket      = std::move(socket);
+			worker.num_threads = std::max(1, threads);
+			workers.push_back(std::move(worker));
+		};
+
+	// All tiles of the image, in render order.
+	int total_threads = 0;
+	for (int i = 0; i < expected_workers; ++i)
+	{
+		total_threads += std::max(1, params.num_threads / std::max(1, distribution.local_workers));
+	}
+	Tiles layout;
+	int const tile_size   = choose_tile_size(params, width, height, total_threads, &layout);
+	int const num_tiles_x = static_cast<int>(std::ceil(float(width) / float(tile_size)));
+	int const num_tiles_y = static_cast<int>(std::ceil(float(height) / float(tile_size)));
+	generate_tile_idx(params.tile_order, num_tiles_x, num_tiles_y, &layout.idx);
+	std::deque<glm::ivec2> pending(layout.idx.begin(), layout.idx.end());
+	int const num_tiles = layout.count();
+
+	auto const disconnect = [&](RemoteWorker& worker)
+		{
+			std::cerr << "[HostRender] " << "Lost a worker, rendering its tiles elsewhere" << std::endl;
+			for (auto it = worker.in_flight.rbegin(); it != worker.in_flight.rend(); ++it)
+			{
+				pending.insert(pending.begin(), it->begin(), it->end());
+			}
+			worker.in_flight.clear();
+			worker.socket.close();
+		};
+
+	// Contiguous runs of the tile order, two tiles per thread.
+	auto const fill = [&](RemoteWorker& worker)
+		{
+			while (worker.socket.is_open() && !pending.empty()
+				&& int(worker.in_flight.size()) < batches_in_flight)
+			{
+				std::size_t const n = std::min<std::size_t>(pending.size(), 2 * worker.num_threads);
+				std::vector<glm::ivec2> batch(pending.begin(), pending.begin() + n);
+				pending.erase(pending.begin(), pending.begin() + n);
+
+				MessageWriter message;
+				message.put(MSG_BATCH);
+				message.put(static_cast<std::uint32_t>(tile_size));
+				message.put(static_cast<std::uint32_t>(batch.size()));
+				message.put(batch.data(), batch.size());
+				worker.in_flight.push_back(std::move(batch));
+				if (!worker.socket.send(message.data()))
+				{
+					disconnect(worker);
+				}
+			}
+		};
+
+	Image frame_buffer(width, height);
+	int tiles_done = 0;
+	int result = 0;
+	auto const start = std::chrono::steady_clock::now();
+	std::vector<char> message;
+	while (tiles_done < num_tiles)
+	{
+		int const elapsed_seconds = static_cast<int>(std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now() - start).count());
+		if (kill_timeout_seconds > 0 && elapsed_seconds > kill_timeout_seconds)
+		{
+			cg_assert(!bool("Process ran into timeout - is there an infinite "
+						"loop?"));
+			result = 1;
+			break;
+		}
+
+		// Accept missing workers, waiting only while nobody renders.
+		bool rendering = false;
+		for (auto& worker : workers)
+		{
+			fill(worker);
+			rendering = rendering || worker.socket.is_open();
+		}
+		if (int(workers.size()) < expected_workers)
+		{
+			accept_worker(rendering ? 0 : 1000);
+		}
+		if (!rendering)
+		{
+			// Workers do not reconnect, so once all expected ones have
+			// connected and dropped, nobody is left to wait for.
+			if (int(workers.size()) >= expected_workers)
+			{
+				std::cerr << "[HostRender] " << "All workers disconnected, giving up" << std::endl;
+				result = 1;
+				break;
+			}
+			if (elapsed_seconds > connect_timeout_seconds)
+			{
+				std::cerr << "[HostRender] " << "No workers left, giving up" << std::endl;
+				result = 1;
+				break;
+			}
+			continue;
+		}
+
+		// Wait for results.
+		std::vector<pollfd>        fds;
+		std::vector<RemoteWorker*> polled;
+		for (auto& worker : workers)
+		{
+			if (worker.socket.is_open())
+			{
+				fds.push_back({ worker.socket.fd(), POLLIN, 0 });
+				polled.push_back(&worker);
+			}
+		}
+		int const ready = poll(fds.data(), fds.size(), 100);
+		if (ready < 0 && errno != EINTR)
+		{
+			std::cerr << "[HostRender] " << "poll() failed" << std::endl;
+			result = 1;
+			break;
+		}
+		for (std::size_t i = 0; ready > 0 && i < fds.size(); ++i)
+		{
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				continue;
+			}
+			RemoteWorker& worker = *polled[i];
+			if (!worker.socket.receive(&message) || worker.in_flight.empty()
+				|| receive_tiles(message, &frame_buffer) != int(worker.in_flight.front().size()))
+			{
+				disconnect(worker);
+				continue;
+			}
+			tiles_done += int(worker.in_flight.front().size());
+			worker.in_flight.pop_front();
+		}
+	}
+
+	for (auto& worker : workers)
+	{
+		MessageWriter done;
+		done.put(MSG_DONE);
+		worker.socket.send(done.data());
+		worker.socket.close();
+	}
+	for (pid_t child : children)
+	{
+		if (result != 0)
+		{
+			kill(child, SIGKILL);
+		}
+		int status = 0;
+		while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+		{
+		}
+	}
+	if (result != 0)
+	{
+		return result;
+	}
+
+	timer.stop();
+	std::cout << "Rendering time: " << timer.getElapsedTimeInMilliSec() << "ms" << std::endl;
+	if (desaturate_on_display(params))
+	{
+		frame_buffer.desaturate();
+	}
+	frame_buffer.save(params.output_file_name.c_str(), 2.2f);
+
+	return 0;
+}
+
+#else
+
+int HostRender::run_coordinator(RaytracingContext& context,
+		LaunchFunc const& launch,
+		int kill_timeout_seconds)
+{
+	(void) context;
+	(void) launch;
+	(void) kill_timeout_seconds;
+	std::cerr << "[HostRender] " << "Distributed rendering is not supported on this platform" << std::endl;
+	return 1;
+}
+
+#endif
@@ -3,6 +3,10 @@
 #include <cglib/rt/raytracing_context.h>
 #include <cglib/rt/scene.h>
 
+#include <algorithm>
+#include <cmath>
+#include <istream>
+
 /*
  * ImGui Notes:
  * - every element needs to have a unique name
@@ -25,10 +29,52 @@ void RaytracingParameters::initialize()
 {
 }
 
+bool RaytracingParameters::derived_parse_option(std::string const& arg, std::istream& is, bool* success)
+{
+	if (arg == "--spp")
+	{
+		*success = bool(is >> spp) && spp >= 1;
+		return true;
+	}
+	if (arg == "--bvh-builder")
+	{
+		std::string builder;
+		*success = bool(is >> builder);
+		bvh_builder = BVH_BUILDER_COUNT;
+		for (int b = 0; b < BVH_BUILDER_COUNT; ++b)
+		{
+			if (builder == bvh_builder_names[b])
+			{
+				bvh_builder = b;
+			}
+		}
+		*success = *success && bvh_builder != BVH_BUILDER_COUNT;
+		return true;
+	}
+	if (arg == "--bvh-traversal")
+	{
+		std::string traversal;
+		*success = bool(is >> traversal);
+		bvh_traversal = BVH_TRAVERSAL_COUNT;
+		for (int t = 0; t < BVH_TRAVERSAL_COUNT; ++t)
+		{
+			if (traversal == bvh_traversal_names[t])
+			{
+				bvh_traversal = t;
+			}
+		}
+		*success = *success && bvh_traversal != BVH_TRAVERSAL_COUNT;
+		return true;
+	}
+	return false;
+}
+
 int RaytracingParameters::display_parameters()
 {
 	bool redraw = false;
 	bool refresh_scene = false;
+	bool reshade = false;
+	bool postprocess = false;
 
 	bool draw_render_settings = true;
 	bool draw_shading_settings = true;
@@ -36,8 +82,8 @@ int RaytracingParameters::display_parameters()
 
 	refresh_scene |= ImGui::Combo("Scene", &active_scene, &RaytracingContext::get_active()->scene_names, RaytracingContext::get_active()->scene_names.size());
 
-	ImGui::DragFloat("Exposure", &exposure, 0.1f, -100.f, 100.f);
-	ImGui::DragFloat("Gamma", &gamma, 0.05f, 0.0f, 100.f);
+	postprocess |= ImGui::DragFloat("Exposure", &exposure, 0.1f, -100.f, 100.f);
+	postprocess |= ImGui::DragFloat("Gamma", &gamma, 0.05f, 0.0f, 100.f);
 
 	bool is_gauss   = dynamic_cast<GaussScene   *>(RaytracingContext::get_active()->get_active_scene());
 	bool is_fourier = dynamic_cast<FourierScene *>(RaytracingContext::get_active()->get_active_scene());
@@ -66,7 +112,16 @@ int RaytracingParameters::display_parameters()
 
 	if(draw_render_settings && ImGui::CollapsingHeader("Render Settings"))
 	{
-		redraw |= ImGui::Combo("Render Mode", &render_mode, &render_mode_names[0], RENDER_MODE_COUNT);
+		int const old_render_mode = render_mode;
+		if (ImGui::Combo("Render Mode", &render_mode, &render_mode_names[0], RENDER_MODE_COUNT))
+		{
+			// Desaturation of a mono image is done on display.
+			auto const is_color = [](int mode) { return mode == RECURSIVE || mode == DESATURATE; };
+			if (is_color(old_render_mode) && is_color(render_mode) && !stereo)
+				postprocess = true;
+			else
+				redraw = true;
+		}
 		if (ImGui::IsItemHovered())
 		{
 			ImGui::SetTooltip(
@@ -78,6 +133,7 @@ int RaytracingParameters::display_parameters()
 "du dv:                   texture coordinate gradient length\n"
 "AABB Intersection Count: Number of AABBs that could be intersected by ray\n"
 "BVH Traversal Time:      Time spent on bvh traversal for primary hit\n"
+"Sample Count:            Number of samples taken by adaptive sampling\n"
 			);
 		}
 		if (render_mode == TIME
@@ -90,8 +146,26 @@ int RaytracingParameters::display_parameters()
 		redraw |= ImGui::DragFloat("Ray Epsilon", &ray_epsilon, 0.00001f, 0.0f, 0.f, "%.7f");
 		redraw |= ImGui::DragFloat("Field of View Y", &fovy);
 		redraw |= ImGui::InputInt("Render Threads", &num_threads);
+		redraw |= ImGui::Combo("Tile Order", &tile_order, tile_order_names, TILE_ORDER_COUNT);
+		refresh_scene |= ImGui::Combo("BVH Builder", &bvh_builder, bvh_builder_names, BVH_BUILDER_COUNT);
+		redraw |= ImGui::Combo("BVH Traversal", &bvh_traversal, bvh_traversal_names, BVH_TRAVERSAL_COUNT);
 		redraw |= ImGui::Checkbox("Stratified Samples", &stratified);
 		redraw |= ImGui::InputInt("Pixel Samples", &spp);
+		redraw |= ImGui::Checkbox("Adaptive Sampling", &adaptive_sampling);
+		if (adaptive_sampling) {
+			redraw |= ImGui::DragFloat("Error Threshold", &adaptive_threshold, 0.001f, 0.f, 1.f, "%.4f");
+			redraw |= ImGui::InputInt("Max Pixel Samples", &max_spp);
+		}
+		redraw |= ImGui::Checkbox("Progressive Rendering", &progressive);
+		if (progressive) {
+			ImGui::InputInt("Max Passes", &max_passes);
+		}
+		redraw |= ImGui::Checkbox("G-Buffer Cache", &gbuffer_cache);
+		ImGui::Checkbox("Dynamic Resolution", &dynamic_resolution);
+		if (dynamic_resolution) {
+			ImGui::InputInt("Max Pixel Scale", &max_pixel_scale);
+			max_pixel_scale = std::max(1, max_pixel_scale);
+		}
 		redraw |= ImGui::Checkbox("Stereo Rendering", &stereo);
 		if (stereo) {
 			redraw |= ImGui::DragFloat("Eye Separation", &eye_separation, 0.01f, 0.f, 0.f);
@@ -101,14 +175,14 @@ int RaytracingParameters::display_parameters()
 
 	if (draw_shading_settings && ImGui::CollapsingHeader("Shading Settings"))
 	{
-		redraw |= ImGui::Checkbox("Diffuse White", &diffuse_white_mode);
-		redraw |= ImGui::Checkbox("Shadows", &shadows);
-		redraw |= ImGui::Checkbox("Ambient Lighting", &ambient);
-		redraw |= ImGui::Checkbox("Diffuse Lighting", &diffuse);
-		redraw |= ImGui::Checkbox("Specular Lighting", &specular);
-		redraw |= ImGui::Checkbox("Reflection", &reflection);
-		redraw |= ImGui::Checkbox("Transform Objects", &transform_objects);
-		redraw |= ImGui::Checkbox("Normal Mapping", &normal_mapping);
+		reshade |= ImGui::Checkbox("Diffuse White", &diffuse_white_mode);
+		reshade |= ImGui::Checkbox("Shadows", &shadows);
+		reshade |= ImGui::Checkbox("Ambient Lighting", &ambient);
+		reshade |= ImGui::Checkbox("Diffuse Lighting", &diffuse);
+		reshade |= ImGui::Checkbox("Specular Lighting", &specular);
+		reshade |= ImGui::Checkbox("Reflection", &reflection);
+		redraw  |= ImGui::Checkbox("Transform Objects", &transform_objects);
+		reshade |= ImGui::Checkbox("Normal Mapping", &normal_mapping);
 	}
 
 	if (draw_texture_settings && ImGui::CollapsingHeader("Texture Settings"))
@@ -119,7 +193,9 @@ int RaytracingParameters::display_parameters()
 
 	auto flags = 0
 		| (redraw        ? GUI::FLAG_REDRAW        : 0)
-		| (refresh_scene ? GUI::FLAG_REFRESH_SCENE : 0);
+		| (refresh_scene ? GUI::FLAG_REFRESH_SCENE : 0)
+		| (reshade       ? GUI::FLAG_RESHADE       : 0)
+		| (postprocess   ? GUI::FLAG_POSTPROCESS   : 0);
 
 	return flags;
 }
@@ -12,6 +12,7 @@
 #include <stdexcept>
 
 #include <cglib/core/thread_local_data.h>
+#include <cglib/core/profiler.h>
 
 
 glm::vec3 reflect(glm::vec3 const& v, glm::vec3 const& n)
@@ -98,7 +99,10 @@ bool visible(
 	glm::vec3 const& from,
 	glm::vec3 const& to)
 {
+	CG_PROFILE_SCOPE(SCOPE_VISIBLE);
+	CG_PROFILE_COUNT(SHADOW_RAYS, 1);
 	data.num_cast_rays++;
+	data.num_rays[RenderData::RAY_SHADOW]++;
     const glm::vec3 d = glm::normalize(to-from);
     const float dist = glm::length(to-from) - 2.f*data.context.params.ray_epsilon;
     Ray ray_eps(from + data.context.params.ray_epsilon * d, d);
@@ -114,6 +118,7 @@ bool visible(
 
 bool shoot_ray(RenderData &data, Ray const& ray, Intersection* isect)
 {
+	CG_PROFILE_SCOPE(SCOPE_SHOOT_RAY);
     Object* object = nullptr;
 
     cg_assert(isect);
@@ -146,6 +151,7 @@ bool shoot_ray(
 	const Ray corner_rays[4],
 	Intersection* isect)
 {
+	CG_PROFILE_SCOPE(SCOPE_SHOOT_RAY);
     Object* object = nullptr;
 
     cg_assert(isect);
@@ -196,15 +202,46 @@ glm::vec3 evaluate_ambient(
 	return contribution;
 }
 
-glm::vec3 evaluate_phong(
-	RenderData &data,			// class containing raytracing information
-	MaterialSample const& mat,	// the material at position
-	glm::vec3 const& P,			// world space position
-	glm::vec3 const& N,			// normal at the position (already normalized)
-	glm::vec3 const& V)			// view vector (already normalized)
+unsigned shading_flags(RaytracingParameters const& params)
+{
+	unsigned flags = 0;
+	if (params.shadows)            flags |= SHADE_SHADOWS;
+	if (params.ambient)            flags |= SHADE_AMBIENT;
+	if (params.diffuse)            flags |= SHADE_DIFFUSE;
+	if (params.specular)           flags |= SHADE_SPECULAR;
+	if (params.reflection)         flags |= SHADE_REFLECTION;
+	if (params.transmission)       flags |= SHADE_TRANSMISSION;
+	if (params.fresnel)            flags |= SHADE_FRESNEL;
+	if (params.dispersion)         flags |= SHADE_DISPERSION;
+	if (params.normal_mapping)     flags |= SHADE_NORMAL_MAPPING;
+	if (params.diffuse_white_mode) flags |= SHADE_DIFFUSE_WHITE;
+	return flags;
+}
+
+// Is the shading feature Flag enabled? Constant unless Flags is SHADE_DYNAMIC,
+// in which case the parameter value is used.
+template <unsigned Flags, unsigned Flag>
+static inline bool shade(bool param)
+{
+	return (Flags & SHADE_DYNAMIC) ? param : (Flags & Flag) != 0;
+}
+
+template <unsigned Flags>
+static glm::vec3 trace_recursive_kernel(RenderData & data, Ray const& ray, int depth);
+
+template <unsigned Flags>
+static glm::vec3 evaluate_phong_kernel(
+	RenderData &data,
+	MaterialSample const& mat,
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V)
 {
 	cg_assert(std::fabs(glm::length(N) - 1.f) < EPSILON);
 	cg_assert(std::fabs(glm::length(V) - 1.f) < EPSILON);
+	CG_PROFILE_SCOPE(SCOPE_SHADE);
+
+	RaytracingParameters const& params = data.context.params;
 
 	glm::vec3 contribution(0.f);
 	// iterate over lights and sum up their contribution
@@ -213,7 +250,7 @@ glm::vec3 evaluate_phong(
 		const glm::vec3 L = glm::normalize(light->getPosition() - P);
 
 		float visibility = 1.f;
-		if (data.context.params.shadows) {
+		if (shade<Flags, SHADE_SHADOWS>(params.shadows)) {
 			// TODO: check if light source is visible
 			if (!visible(data, P, light->getPosition())) {
 				visibility = 0.f;
@@ -221,7 +258,7 @@ glm::vec3 evaluate_phong(
 		}
 
 		glm::vec3 diffuse(0.f);
-		if (data.context.params.diffuse) {
+		if (shade<Flags, SHADE_DIFFUSE>(params.diffuse)) {
 			// TODO: compute diffuse component of phong model
 			if (visibility > 0.f) {
 				diffuse = std::max(0.f, glm::dot(N, L)) * mat.k_d;
@@ -229,7 +266,7 @@ glm::vec3 evaluate_phong(
 		}
 
 		glm::vec3 specular(0.f);
-		if (data.context.params.specular) {
+		if (shade<Flags, SHADE_SPECULAR>(params.specular)) {
 			// TODO: compute specular component of phong model
 			if ((visibility > 0.f) && (glm::dot(L, N) > 0.f)) {
 				const glm::vec3 R = reflect(L, N);
@@ -237,7 +274,7 @@ glm::vec3 evaluate_phong(
 			}
 		}
 
-		glm::vec3 ambient = data.context.params.ambient ? mat.k_a : glm::vec3(0.0f);
+		glm::vec3 ambient = shade<Flags, SHADE_AMBIENT>(params.ambient) ? mat.k_a : glm::vec3(0.0f);
 
 		// TODO: modify this and implement the phong model as specified on the exercise sheet
 		const float dist = glm::length(light->getPosition() - P);
@@ -247,25 +284,27 @@ glm::vec3 evaluate_phong(
 	return contribution;
 }
 
-glm::vec3 evaluate_reflection(
+template <unsigned Flags>
+static glm::vec3 evaluate_reflection_kernel(
 	RenderData & data,
 	int depth,
-	glm::vec3 const& P, // world space position
-	glm::vec3 const& N, // Normal (already normalized)
-	glm::vec3 const& V) // View vector (already normalized)
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V)
 {
 	// TODO: calculate reflective contribution by contructing and shooting a reflection ray.
 	const glm::vec3 R = reflect(V, N);
 	Ray ray_reflection(P + data.context.params.ray_epsilon * R, R);
-	return trace_recursive(data, ray_reflection, depth + 1);
+	return trace_recursive_kernel<Flags>(data, ray_reflection, depth + 1);
 }
 
-glm::vec3 evaluate_transmission(
+template <unsigned Flags>
+static glm::vec3 evaluate_transmission_kernel(
 	RenderData & data,
-	int depth,          // recursion depth
-	glm::vec3 const& P, // world space position
-	glm::vec3 const& N, // Normal (already normalized)
-	glm::vec3 const& V, // View vector (already normalized)
+	int depth,
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V,
 	float eta)
 {
 	// TODO: calculate transmissive contribution by constructing and shooting a transmission ray.
@@ -274,60 +313,115 @@ glm::vec3 evaluate_transmission(
 	if (refract(V, N, eta, &T))
 	{
 		Ray ray_transmission(P + data.context.params.ray_epsilon * T, T);
-		contribution = trace_recursive(data, ray_transmission, depth + 1);
+		contribution = trace_recursive_kernel<Flags>(data, ray_transmission, depth + 1);
 	}
 	return contribution;
 }
 
-glm::vec3 handle_transmissive_material_single_ior(
-	RenderData &data,			// class containing raytracing information
-	int depth,					// the current recursion depth
-	glm::vec3 const& P,			// world space position
-	glm::vec3 const& N,			// normal at the position (already normalized)
-	glm::vec3 const& V,			// view vector (already normalized)
-	float eta)					// the relative refraction index
+template <unsigned Flags>
+static glm::vec3 handle_transmissive_material_single_ior_kernel(
+	RenderData &data,
+	int depth,
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V,
+	float eta)
 {
-	if (data.context.params.fresnel) {
+	if (shade<Flags, SHADE_FRESNEL>(data.context.params.fresnel)) {
 		// TODO: implement fresnel handling here.
 		const float F = fresnel(V, N, eta);
 
 		cg_assert(F >= 0.f);
 		cg_assert(F <= 1.f);
 
-		return     	  F * evaluate_reflection(data, depth, P, N, V)
-			+ (1.f - F) * evaluate_transmission(data, depth, P, N, V, eta);
+		return     	  F * evaluate_reflection_kernel<Flags>(data, depth, P, N, V)
+			+ (1.f - F) * evaluate_transmission_kernel<Flags>(data, depth, P, N, V, eta);
 	}
 	else {
 		// just regular transmission
-		return evaluate_transmission(data, depth, P, N, V, eta);
+		return evaluate_transmission_kernel<Flags>(data, depth, P, N, V, eta);
 	}
 }
 
-
-glm::vec3 handle_transmissive_material(
+template <unsigned Flags>
+static glm::vec3 handle_transmissive_material_kernel(
 	RenderData & data,
-	int depth,          // recursion depth
-	glm::vec3 const& P, // world space position
-	glm::vec3 const& N, // Normal (already normalized)
-	glm::vec3 const& V, // View vector (already normalized)
+	int depth,
+	glm::vec3 const& P,
+	glm::vec3 const& N,
+	glm::vec3 const& V,
 	glm::vec3 const& eta_of_channel)
 {
-	if (data.context.params.dispersion && !(eta_of_channel[0] == eta_of_channel[1] && eta_of_channel[0] == eta_of_channel[2])) {
+	if (shade<Flags, SHADE_DISPERSION>(data.context.params.dispersion) 
+			&& !(eta_of_channel[0] == eta_of_channel[1] && eta_of_channel[0] == eta_of_channel[2])) {
 		// TODO: split ray into 3 rays (one for each color channel) and implement dispersion here
 		glm::vec3 contribution(0.f);
 		for (int i = 0; i < 3; ++i) {
 			float eta = eta_of_channel[i];
-			contribution[i] += handle_transmissive_material_single_ior(data, depth, P, N, V, eta)[i];
+			contribution[i] += handle_transmissive_material_single_ior_kernel<Flags>(data, depth, P, N, V, eta)[i];
 		}
 		return contribution;
 	}
 	else {
 		const float eta = 1.f/3.f*(eta_of_channel[0]+eta_of_channel[1]+eta_of_channel[2]);
-		return handle_transmissive_material_single_ior(data, depth, P, N, V, eta);
+		return handle_transmissive_material_single_ior_kernel<Flags>(data, depth, P, N, V, eta);
 	}
 	return glm::vec3(0.f);
 }
 
+glm::vec3 evaluate_phong(
+	RenderData &data,			// class containing raytracing information
+	MaterialSample const& mat,	// the material at position
+	glm::vec3 const& P,			// world space position
+	glm::vec3 const& N,			// normal at the position (already normalized)
+	glm::vec3 const& V)			// view vector (already normalized)
+{
+	return evaluate_phong_kernel<SHADE_DYNAMIC>(data, mat, P, N, V);
+}
+
+glm::vec3 evaluate_reflection(
+	RenderData & data,
+	int depth,
+	glm::vec3 const& P, // world space position
+	glm::vec3 const& N, // Normal (already normalized)
+	glm::vec3 const& V) // View vector (already normalized)
+{
+	return evaluate_reflection_kernel<SHADE_DYNAMIC>(data, depth, P, N, V);
+}
+
+glm::vec3 evaluate_transmission(
+	RenderData & data,
+	int depth,          // recursion depth
+	glm::vec3 const& P, // world space position
+	glm::vec3 const& N, // Normal (already normalized)
+	glm::vec3 const& V, // View vector (already normalized)
+	float eta)
+{
+	return evaluate_transmission_kernel<SHADE_DYNAMIC>(data, depth, P, N, V, eta);
+}
+
+glm::vec3 handle_transmissive_material_single_ior(
+	RenderData &data,			// class containing raytracing information
+	int depth,					// the current recursion depth
+	glm::vec3 const& P,			// world space position
+	glm::vec3 const& N,			// normal at the position (already normalized)
+	glm::vec3 const& V,			// view vector (already normalized)
+	float eta)					// the relative refraction index
+{
+	return handle_transmissive_material_single_ior_kernel<SHADE_DYNAMIC>(data, depth, P, N, V, eta);
+}
+
+glm::vec3 handle_transmissive_material(
+	RenderData & data,
+	int depth,          // recursion depth
+	glm::vec3 const& P, // world space position
+	glm::vec3 const& N, // Normal (already normalized)
+	glm::vec3 const& V, // View vector (already normalized)
+	glm::vec3 const& eta_of_channel)
+{
+	return handle_transmissive_material_kernel<SHADE_DYNAMIC>(data, depth, P, N, V, eta_of_channel);
+}
+
 glm::vec3
 env_map_lookup(RenderData &data, const glm::vec3 &dir)
 {
@@ -349,18 +443,19 @@ env_map_lookup(RenderData &data, const glm::vec3 &dir)
 	}
 }
 
-glm::vec3 trace_recursive(RenderData & data, Ray const& ray, int depth)
+// Counts and shoots the ray. Primary rays also compute the pixel footprint
+// if the texture filter needs it.
+static bool intersect_scene(RenderData & data, Ray const& ray, int depth, Intersection* isect)
 {
-    if (depth > data.context.params.max_depth) {
-        return glm::vec3(0.f);
-    }
-
-    glm::vec3 contribution(0.f);
-    Intersection isect;
-
-	bool found_intersection = false;
-    if ((   data.context.params.tex_filter_mode == TextureFilterMode::TRILINEAR
-	     || data.context.params.tex_filter_mode == TextureFilterMode::DEBUG_MIP)
+	RaytracingParameters const& params = data.context.params;
+
+	data.num_rays[depth == 0 ? RenderData::RAY_PRIMARY : RenderData::RAY_SECONDARY]++;
+	if (depth == 0)
+		CG_PROFILE_COUNT(PRIMARY_RAYS, 1);
+	else
+		CG_PROFILE_COUNT(SECONDARY_RAYS, 1);
+    if ((   params.tex_filter_mode == TextureFilterMode::TRILINEAR
+	     || params.tex_filter_mode == TextureFilterMode::DEBUG_MIP)
 		&& depth == 0)
 	{
         // shoot ray and compute pixel footprint with corner rays
@@ -368,12 +463,39 @@ glm::vec3 trace_recursive(RenderData & data, Ray const& ray, int depth)
                        createPrimaryRay(data, (data.x + 0.5f), (data.y + 0.5f)),
                        createPrimaryRay(data, (data.x - 0.5f), (data.y + 0.5f)),
                        createPrimaryRay(data, (data.x + 0.5f), (data.y - 0.5f))};
-        found_intersection = shoot_ray(data, ray, rays, &isect);
+        return shoot_ray(data, ray, rays, isect);
     }
-    else {
-        found_intersection = shoot_ray(data, ray, &isect);
+    return shoot_ray(data, ray, isect);
+}
+
+template <unsigned Flags>
+static glm::vec3 trace_recursive_kernel(RenderData & data, Ray const& ray, int depth)
+{
+	RaytracingParameters const& params = data.context.params;
+
+    if (depth > params.max_depth) {
+        return glm::vec3(0.f);
     }
 
+    glm::vec3 contribution(0.f);
+    Intersection isect;
+
+	bool found_intersection = false;
+	GBufferSample* const gbuffer = depth == 0 ? data.gbuffer : nullptr;
+	if (gbuffer && gbuffer->frame == data.gbuffer_frame) {
+		// Only the shading has changed, reuse the primary hit.
+		found_intersection = gbuffer->hit;
+		isect = gbuffer->isect;
+	}
+	else {
+		found_intersection = intersect_scene(data, ray, depth, &isect);
+		if (gbuffer) {
+			gbuffer->frame = data.gbuffer_frame;
+			gbuffer->hit   = found_intersection;
+			gbuffer->isect = isect;
+		}
+	}
+
 	if(!found_intersection) {
 		return env_map_lookup(data, ray.direction);
 	}
@@ -382,29 +504,61 @@ glm::vec3 trace_recursive(RenderData & data, Ray const& ray, int depth)
 		data.isect = isect;
 
     MaterialSample mat = isect.material;
-	if (data.context.params.diffuse_white_mode) {
+	if (shade<Flags, SHADE_DIFFUSE_WHITE>(params.diffuse_white_mode)) {
 		mat.k_a = glm::vec3(0.1f);
 		mat.k_d = glm::vec3(1.0f);
 		mat.k_s = glm::vec3(0.0f);
 		mat.k_r = glm::vec3(0.0f);
 		mat.k_t = glm::vec3(0.0f);
 	}
-    const glm::vec3 N = data.context.params.normal_mapping ? isect.shading_normal : isect.normal;
+    const glm::vec3 N = shade<Flags, SHADE_NORMAL_MAPPING>(params.normal_mapping) ? isect.shading_normal : isect.normal;
     const glm::vec3 V = -ray.direction;
     const bool hit_backside = glm::dot(isect.geometric_normal, V) < 0.f;
 
     if (!hit_backside) {
-		contribution = evaluate_phong(data, mat, isect.position, N, V);
+		contribution = evaluate_phong_kernel<Flags>(data, mat, isect.position, N, V);
     }
 
     // recursive tracing
-    if (!hit_backside && data.context.params.reflection && glm::length(mat.k_r) > 0.f) {
-		contribution += mat.k_r * evaluate_reflection(data, depth, isect.position, N, V);
+    if (!hit_backside && shade<Flags, SHADE_REFLECTION>(params.reflection) && glm::length(mat.k_r) > 0.f) {
+		contribution += mat.k_r * evaluate_reflection_kernel<Flags>(data, depth, isect.position, N, V);
     }
-    if (data.context.params.transmission && glm::length(mat.k_t) > 0.f) {
-		contribution += mat.k_t * handle_transmissive_material(data, depth, isect.position, N, V, mat.eta);
+    if (shade<Flags, SHADE_TRANSMISSION>(params.transmission) && glm::length(mat.k_t) > 0.f) {
+		contribution += mat.k_t * handle_transmissive_material_kernel<Flags>(data, depth, isect.position, N, V, mat.eta);
     }
 
     return contribution;
 }
 
+// The default parameters and the switches toggled most often on top of them.
+// All other combinations use the generic kernel.
+static const unsigned SHADE_DEFAULT = SHADE_SHADOWS | SHADE_AMBIENT | SHADE_DIFFUSE | SHADE_SPECULAR
+	| SHADE_REFLECTION | SHADE_TRANSMISSION | SHADE_FRESNEL;
+
+TraceFunc select_trace_kernel(unsigned flags)
+{
+	switch (flags) {
+		case SHADE_DEFAULT:
+			return &trace_recursive_kernel<SHADE_DEFAULT>;
+		case SHADE_DEFAULT | SHADE_NORMAL_MAPPING:
+			return &trace_recursive_kernel<SHADE_DEFAULT | SHADE_NORMAL_MAPPING>;
+		case SHADE_DEFAULT | SHADE_DISPERSION:
+			return &trace_recursive_kernel<SHADE_DEFAULT | SHADE_DISPERSION>;
+		case SHADE_DEFAULT | SHADE_DISPERSION | SHADE_NORMAL_MAPPING:
+			return &trace_recursive_kernel<SHADE_DEFAULT | SHADE_DISPERSION | SHADE_NORMAL_MAPPING>;
+		case SHADE_DEFAULT & ~SHADE_SHADOWS:
+			return &trace_recursive_kernel<SHADE_DEFAULT & ~SHADE_SHADOWS>;
+		case SHADE_DEFAULT | SHADE_DIFFUSE_WHITE:
+			return &trace_recursive_kernel<SHADE_DEFAULT | SHADE_DIFFUSE_WHITE>;
+		default:
+			return &trace_recursive_kernel<SHADE_DYNAMIC>;
+	}
+}
+
+glm::vec3 trace_recursive(RenderData & data, Ray const& ray, int depth)
+{
+	TraceFunc const trace = data.trace_kernel 
+		? data.trace_kernel 
+		: select_trace_kernel(shading_flags(data.context.params));
+	return trace(data, ray, depth);
+}
@@ -10,13 +10,10 @@ generate_random_samples(
 		ThreadLocalData *tld)
 {
 	generated_samples->resize(grid_x * grid_y);
+	if (generated_samples->empty())
+		return;
 
-	for(int y = 0; y < grid_y; y++) {
-		for(int x = 0; x < grid_x; x++) {
-			glm::vec2 &s = (*generated_samples)[y * grid_x + x];
-			s = (glm::vec2(tld->rand(), tld->rand()));
-		}
-	}
+	tld->rand(&(*generated_samples)[0].x, 2 * grid_x * grid_y);
 }
 
 void
@@ -27,12 +24,16 @@ generate_stratified_samples(
 		ThreadLocalData *tld)
 {
 	generated_samples->resize(grid_x * grid_y);
+	if (generated_samples->empty())
+		return;
+
+	tld->rand(&(*generated_samples)[0].x, 2 * grid_x * grid_y);
 
+	glm::vec2 const scale = 1.f / glm::vec2(grid_x, grid_y);
 	for(int y = 0; y < grid_y; y++) {
 		for(int x = 0; x < grid_x; x++) {
 			glm::vec2 &s = (*generated_samples)[y * grid_x + x];
-			s = (glm::vec2(x, y) + glm::vec2(tld->rand(), tld->rand()))
-				/ glm::vec2(grid_x, grid_y);
+			s = (glm::vec2(x, y) + s) * scale;
 		}
 	}
 }
@@ -13,6 +13,7 @@
 
 #include <cglib/core/camera.h>
 #include <cglib/core/image.h>
+#include <cglib/core/thread_pool.h>
 
 #include <sstream>
 #include <random>
@@ -28,6 +29,18 @@ set_active_camera()
 		camera->set_active();
 }
 
+void Scene::
+rebuild_bvhs(RaytracingParameters const& params)
+{
+	for (auto& object : objects) {
+		BVH* bvh = dynamic_cast<BVH*>(object.get());
+		if (bvh && bvh->builder != params.bvh_builder)
+			bvh->rebuild(params.bvh_builder);
+		if (bvh)
+			bvh->traversal = params.bvh_traversal;
+	}
+}
+
 
 FourierScene::FourierScene(RaytracingParameters& params)
 {
@@ -195,8 +208,9 @@ void TriangleScene::init_scene(RaytracingParameters const& params)
     soups.clear();
 
 	soups.emplace_back(createTriangleSoup(params.num_triangles));
-    objects.emplace_back(new BVH(*soups.back()));
+    objects.emplace_back(new BVH(*soups.back(), params.bvh_builder));
     lights.emplace_back(new Light(glm::vec3(0.f, 200.f, 400.f), glm::vec3(15000.f)));
+	rebuild_bvhs(params);
 }
 
 void TriangleScene::refresh_scene(RaytracingParameters const& params)
@@ -205,7 +219,8 @@ void TriangleScene::refresh_scene(RaytracingParameters const& params)
     objects.clear();
     
 	soups.emplace_back(createTriangleSoup(params.num_triangles));
-	objects.emplace_back(new BVH(*soups.back()));
+	objects.emplace_back(new BVH(*soups.back(), params.bvh_builder));
+	rebuild_bvhs(params);
 }
 
 void TriangleScene::init_camera(RaytracingParameters& params)
@@ -231,23 +246,27 @@ void MonkeyScene::init_scene(RaytracingParameters const& params)
     textures.clear();
     soups.clear();
 
+	// Load the environment map on the thread pool while we set up the rest.
+	// Scenes are built with HostRender::build_scenes() or while rendering,
+	// so this is the pool configured by the parameters.
+	auto appartment_env = ThreadPool::get_active().submit(ThreadPool::PRIORITY_NORMAL, []()
+		{
+			std::shared_ptr<Image> appartment = std::make_shared<Image>();
+			appartment->load("assets/appartment.jpg", 1.f);
+			auto texture = std::make_shared<ImageTexture>(*appartment,
+				BILINEAR, REPEAT);
+			texture->create_mipmap();
+			return texture;
+		});
 
     textures.insert({"floor", std::make_shared<ImageTexture>(
 		"assets/checker.tga", params.get_tex_filter_mode(), 
 		params.get_tex_wrap_mode(), 2.2f)});
 	textures["floor"]->create_mipmap();
 
-	std::shared_ptr<Image> appartment = std::make_shared<Image>();
-	appartment->load("assets/appartment.jpg", 1.f);
-    textures.insert({"appartment_env",          
-		std::make_shared<ImageTexture>(*appartment,
-		BILINEAR, REPEAT)});
-	textures["appartment_env"]->create_mipmap();
-	env_map = textures["appartment_env"].get();
-	
     soups.push_back(std::make_shared<TriangleSoup>(
 		"assets/suzanne.obj", &this->textures));
-    objects.emplace_back(new BVH(*soups.back()));
+    objects.emplace_back(new BVH(*soups.back(), params.bvh_builder));
 	objects.back()->set_transform_object_to_world(
 		glm::translate(glm::mat4(1.0), glm::vec3(0.f, 2.f, 0.f)) * 
 		glm::scale(glm::mat4(1.0), glm::vec3(3.f, 3.f, 3.f)));
@@ -265,11 +284,14 @@ void MonkeyScene::init_scene(RaytracingParameters const& params)
     lights.emplace_back(new Light(
 		glm::vec3(0.f, 12.f, 6.f), glm::vec3(3.f)));
 
+    textures.insert({"appartment_env", appartment_env.get()});
 	env_map = textures["appartment_env"].get();
+	rebuild_bvhs(params);
 }
 
 void MonkeyScene::refresh_scene(RaytracingParameters const& params)
 {
+	rebuild_bvhs(params);
 }
 
 void MonkeyScene::init_camera(RaytracingParameters& params)
@@ -303,7 +325,7 @@ void SponzaScene::init_scene(RaytracingParameters const& params)
 
 	auto objTriangles = std::make_shared<TriangleSoup>("assets/crytek-sponza/sponza_subdiv3.obj", &this->textures);
 	soups.push_back(objTriangles);
-	objects.emplace_back(new BVH(*objTriangles));
+	objects.emplace_back(new BVH(*objTriangles, params.bvh_builder));
 	objects.back()->set_transform_object_to_world(
 		glm::scale(glm::mat4(1.0), glm::vec3(0.01f)));
 	
@@ -318,6 +340,7 @@ void SponzaScene::refresh_scene(RaytracingParameters const& params)
 		init_scene(params);
 		scene_loaded = true;
 	}
+	rebuild_bvhs(params);
 	for (auto &tex : textures) {
 		tex.second->filter_mode = params.get_tex_filter_mode();
 		tex.second->wrap_mode = params.get_tex_wrap_mode();
@@ -3,6 +3,8 @@
 #include <cglib/core/image.h>
 #include <cglib/core/glmstream.h>
 #include <cglib/core/assert.h>
+#include <cglib/core/parallel.h>
+#include <cglib/core/profiler.h>
 
 #include <algorithm>
 
@@ -71,17 +73,19 @@ create_mipmap()
 		size_x = std::max(1, size_x/2);
 		size_y = std::max(1, size_y/2);
 		mip_levels.emplace_back(new Image(size_x, size_y));
-		for (int x = 0; x < size_x; x++) {
-			for (int y = 0; y < size_y; y++) {
+		Image const& src = *mip_levels[level];
+		Image&       dst = *mip_levels[level+1];
+		parallel_for(0, size_y, [&](int y) {
+			for (int x = 0; x < size_x; x++) {
 				glm::vec4 mean(0.f);
 				for (int xx = 0; xx < cx; xx++) {
 					for (int yy = 0; yy < cy; yy++) {
-						mean += mip_levels[level]->getPixel(2*x+xx, 2*y+yy);
+						mean += src.getPixel(2*x+xx, 2*y+yy);
 					}
 				}
-				mip_levels[level+1]->setPixel(x, y, mean/float(cx*cy));
+				dst.setPixel(x, y, mean/float(cx*cy));
 			}
-		}
+		});
 	}
 }
 
@@ -155,6 +159,7 @@ struct ImageTextureWrapReference
 glm::vec4 ImageTexture::
 get_texel(int level, int x, int y) const
 {
+	CG_PROFILE_COUNT(TEXTURE_FETCHES, 1);
 	if (filter_mode == WHITE) {
 		return glm::vec4(1.f);
 	}